@@ -5,11 +5,18 @@
   License - GPL-3.0
 */
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <thread>
 #include <vector>
-#include <bitset>
 
 #include "bitboard.h"
+#include "misc.h"
+#include "tables.h"
 #include "types.h"
 
 namespace Stockfish {
@@ -20,7 +27,15 @@ namespace {
   // Positions with the pawn on files E to H will be mirrored before probing.
   constexpr unsigned MAX_INDEX = 2*24*64*64; // stm * psq * wksq * bksq = 196608
 
-  std::bitset<MAX_INDEX> KPKBitbase;
+  // The bitbase, one bit per index, set for the wins. It is the one generated
+  // into tables.h, unless that does not validate and it is generated at startup.
+  const uint64_t* KPKBitbase;
+  std::vector<uint64_t> generatedBitbase;
+
+  static_assert(sizeof(Tables::KPKBitbase) * 8 == MAX_INDEX, "Wrong KPK bitbase size in tables.h");
+
+  // The optional bitbases, empty unless enabled with the "Bitbases" option
+  std::vector<uint64_t> KBPKBitbase, KRKPBitbase;
 
   // A KPK bitbase index is an integer in [0, IndexMax] range
   //
@@ -35,6 +50,30 @@ namespace {
     return int(wksq) | (bksq << 6) | (stm << 12) | (file_of(psq) << 13) | ((RANK_7 - rank_of(psq)) << 15);
   }
 
+  // A KBPK bitbase index, for a rook pawn on the A file, which is the wrong
+  // bishop case: with the pawn on another file the endgame is a plain win.
+  //
+  // bit  0- 5: white king square
+  // bit  6-11: black king square
+  // bit 12-17: white bishop square
+  // bit    18: side to move
+  // bit 19-21: white pawn RANK_7 - rank
+  unsigned kbpk_index(Color stm, Square wksq, Square bksq, Square bsq, Square psq) {
+    return int(wksq) | (bksq << 6) | (bsq << 12) | (stm << 18) | ((RANK_7 - rank_of(psq)) << 19);
+  }
+
+  // A KRKP bitbase index, white having the rook and black the pawn
+  //
+  // bit  0- 5: white king square
+  // bit  6-11: black king square
+  // bit 12-17: white rook square
+  // bit    18: side to move
+  // bit 19-20: black pawn file (from FILE_A to FILE_D)
+  // bit 21-23: black pawn rank - RANK_2
+  unsigned krkp_index(Color stm, Square wksq, Square bksq, Square rsq, Square psq) {
+    return int(wksq) | (bksq << 6) | (rsq << 12) | (stm << 18) | (file_of(psq) << 19) | ((rank_of(psq) - RANK_2) << 21);
+  }
+
   enum Result {
     INVALID = 0,
     UNKNOWN = 1,
@@ -44,46 +83,282 @@ namespace {
 
   Result& operator|=(Result& r, Result v) { return r = Result(r | v); }
 
+  // Results of the positions of a bitbase being generated, shared by the
+  // threads of the generation, which write each result once.
+  struct Results {
+    Result operator[](unsigned idx) const { return Result(results[idx].load(std::memory_order_relaxed)); }
+
+    std::atomic<uint8_t>* results;
+  };
+
+  // The material classes describe the positions of an endgame for retrograde()
+  // below: the number of indices, the decoding of an index, the positions that
+  // are classified from the start, and the results of the moves of the others.
+  // White is the strong side, and the results are from its point of view.
+
   struct KPKPosition {
-    KPKPosition() = default;
+    static constexpr unsigned Size = MAX_INDEX;
+
     explicit KPKPosition(unsigned idx);
-    operator Result() const { return result; }
-    Result classify(const std::vector<KPKPosition>& db);
+    Result moves(const Results& db) const;
 
     Color stm;
     Square ksq[COLOR_NB], psq;
     Result result;
   };
 
+  struct KBPKPosition {
+    static constexpr unsigned Size = 6 << 19;
+
+    explicit KBPKPosition(unsigned idx);
+    Result moves(const Results& db) const;
+    Result promotion(PieceType pt) const;
+
+    Color stm;
+    Square wksq, bksq, bsq, psq;
+    Bitboard occupied, attacked;
+    Result result;
+  };
+
+  struct KRKPPosition {
+    static constexpr unsigned Size = 6 << 21;
+
+    explicit KRKPPosition(unsigned idx);
+    Result moves(const Results& db) const;
+    Result krk(Square ksq, Square rook) const;
+    Result promotion(Square to) const;
+    Bitboard pawn_moves() const;
+
+    Color stm;
+    Square wksq, bksq, rsq, psq;
+    Bitboard occupied, attacked;
+    Result result;
+  };
+
+
+  // retrograde() classifies all the positions of an endgame, and returns its
+  // bitbase, one bit per index, set for the wins. The positions are classified
+  // by successive passes, until none of the unknown positions can be changed
+  // to either wins or draws, each pass being split among the given number of
+  // threads. A thread may see the results of the current pass from the others,
+  // which only saves passes, as a position is resolved once for all.
+
+  template<typename Material>
+  std::vector<uint64_t> retrograde(size_t threadCount) {
+
+    constexpr unsigned Size = Material::Size;
+
+    threadCount = std::max(threadCount, size_t(1));
+
+    std::unique_ptr<std::atomic<uint8_t>[]> results(new std::atomic<uint8_t>[Size]);
+    std::vector<uint64_t> bitbase((Size + 63) / 64);
+    const Results db = { results.get() };
+    std::atomic<bool> repeat;
+
+    // Run the given function on as many slices of the indices as threads. The
+    // slices are multiples of 64 indices, so that they fill their own words.
+    auto parallel = [&](auto f) {
+
+        std::vector<std::thread> threads;
+        const unsigned words = unsigned(bitbase.size());
+
+        for (size_t i = 0; i < threadCount; ++i)
+        {
+            const unsigned begin = unsigned(words * i / threadCount) * 64;
+            const unsigned end = std::min(unsigned(words * (i + 1) / threadCount) * 64, Size);
+
+            threads.emplace_back(f, begin, end);
+        }
+
+        for (std::thread& th : threads)
+            th.join();
+    };
+
+    // Initialize db with known win / draw positions
+    parallel([&](unsigned begin, unsigned end) {
+        for (unsigned idx = begin; idx < end; ++idx)
+            results[idx].store(uint8_t(Material(idx).result), std::memory_order_relaxed);
+    });
+
+    // White to move: If one move leads to a position classified as WIN, the result
+    // of the current position is WIN. If all moves lead to positions classified
+    // as DRAW, the current position is classified as DRAW, otherwise the current
+    // position is classified as UNKNOWN.
+    //
+    // Black to move: If one move leads to a position classified as DRAW, the result
+    // of the current position is DRAW. If all moves lead to positions classified
+    // as WIN, the position is classified as WIN, otherwise the current position is
+    // classified as UNKNOWN.
+    do {
+        repeat = false;
+
+        parallel([&](unsigned begin, unsigned end) {
+            bool changed = false;
+
+            for (unsigned idx = begin; idx < end; ++idx)
+                if (db[idx] == UNKNOWN)
+                {
+                    const Material pos(idx);
+                    const Result Good = (pos.stm == WHITE ? WIN   : DRAW);
+                    const Result Bad  = (pos.stm == WHITE ? DRAW  : WIN);
+
+                    Result r = pos.moves(db);
+                    r = r & Good ? Good : r & UNKNOWN ? UNKNOWN : Bad;
+
+                    if (r != UNKNOWN)
+                    {
+                        results[idx].store(uint8_t(r), std::memory_order_relaxed);
+                        changed = true;
+                    }
+                }
+
+            if (changed)
+                repeat = true;
+        });
+    } while (repeat);
+
+    // Fill the bitbase with the decisive results
+    parallel([&](unsigned begin, unsigned end) {
+        for (unsigned idx = begin; idx < end; ++idx)
+            if (db[idx] == WIN)
+                bitbase[idx / 64] |= 1ULL << (idx % 64);
+    });
+
+    return bitbase;
+  }
+
+
+  // load_or_generate() reads a bitbase from the cache directory if it holds a
+  // valid one, and otherwise generates it and writes it there. A cache file
+  // starts with the number of positions and the checksum of the bitbase.
+
+  template<typename Material>
+  std::vector<uint64_t> load_or_generate(const std::string& name, const std::string& path, size_t threads) {
+
+    const bool cached = !path.empty() && path != "<empty>";
+    const std::string fileName = path + "/" + name + ".bb";
+    std::vector<uint64_t> bitbase((Material::Size + 63) / 64);
+    uint64_t header[2];
+
+    if (cached)
+    {
+        std::ifstream file(fileName, std::ios::binary);
+
+        if (   file.read(reinterpret_cast<char*>(header), sizeof(header))
+            && file.read(reinterpret_cast<char*>(bitbase.data()), bitbase.size() * sizeof(uint64_t))
+            && header[0] == Material::Size
+            && header[1] == checksum(bitbase.data(), bitbase.size()))
+        {
+            sync_cout << "info string Loaded the " << name << " bitbase from " << fileName << sync_endl;
+            return bitbase;
+        }
+    }
+
+    TimePoint start = now();
+    bitbase = retrograde<Material>(threads);
+
+    sync_cout << "info string Generated the " << name << " bitbase in "
+              << now() - start << " ms" << sync_endl;
+
+    if (cached)
+    {
+        std::ofstream file(fileName, std::ios::binary);
+
+        header[0] = Material::Size;
+        header[1] = checksum(bitbase.data(), bitbase.size());
+
+        if (  !file.write(reinterpret_cast<const char*>(header), sizeof(header))
+            || !file.write(reinterpret_cast<const char*>(bitbase.data()), bitbase.size() * sizeof(uint64_t)))
+            sync_cout << "info string Cannot write " << fileName << sync_endl;
+    }
+
+    return bitbase;
+  }
+
+  bool test(const std::vector<uint64_t>& bitbase, unsigned idx) {
+    return bitbase[idx / 64] & (1ULL << (idx % 64));
+  }
+
 } // namespace
 
+
 bool Bitbases::probe(Square wksq, Square wpsq, Square bksq, Color stm) {
 
   assert(file_of(wpsq) <= FILE_D);
 
-  return KPKBitbase[index(stm, bksq, wksq, wpsq)];
+  unsigned idx = index(stm, bksq, wksq, wpsq);
+  return KPKBitbase[idx / 64] & (1ULL << (idx % 64));
 }
 
 
+/// Bitbases::probe_kbpk() tells whether white wins KBPK with its pawn on the
+/// A file, and Bitbases::probe_krkp() whether white wins KRKP with the black
+/// pawn on files A-D. They need the bitbases to be available().
+
+bool Bitbases::probe_kbpk(Square wksq, Square wbsq, Square wpsq, Square bksq, Color stm) {
+
+  assert(available() && file_of(wpsq) == FILE_A);
+
+  return test(KBPKBitbase, kbpk_index(stm, wksq, bksq, wbsq, wpsq));
+}
+
+bool Bitbases::probe_krkp(Square wksq, Square wrsq, Square bksq, Square bpsq, Color stm) {
+
+  assert(available() && file_of(bpsq) <= FILE_D);
+
+  return test(KRKPBitbase, krkp_index(stm, wksq, bksq, wrsq, bpsq));
+}
+
+bool Bitbases::available() {
+  return !KRKPBitbase.empty();
+}
+
+
+/// Bitbases::init() validates the bitbase of tables.h against its checksum,
+/// and falls back on generating it, which takes a few tens of milliseconds.
+
 void Bitbases::init() {
 
-  std::vector<KPKPosition> db(MAX_INDEX);
-  unsigned idx, repeat = 1;
+  constexpr size_t Words = MAX_INDEX / 64;
 
-  // Initialize db with known win / draw positions
-  for (idx = 0; idx < MAX_INDEX; ++idx)
-      db[idx] = KPKPosition(idx);
+  KPKBitbase = Tables::KPKBitbase;
 
-  // Iterate through the positions until none of the unknown positions can be
-  // changed to either wins or draws (15 cycles needed).
-  while (repeat)
-      for (repeat = idx = 0; idx < MAX_INDEX; ++idx)
-          repeat |= (db[idx] == UNKNOWN && db[idx].classify(db) != UNKNOWN);
+  if (checksum(Tables::KPKBitbase, Words) != Tables::KPKChecksum)
+  {
+      sync_cout << "info string The KPK bitbase of tables.h does not validate, "
+                << "regenerate it with 'make tables'" << sync_endl;
 
-  // Fill the bitbase with the decisive results
-  for (idx = 0; idx < MAX_INDEX; ++idx)
-      if (db[idx] == WIN)
-          KPKBitbase.set(idx);
+      generatedBitbase = generate();
+      KPKBitbase = generatedBitbase.data();
+  }
+
+  assert(generate() == std::vector<uint64_t>(KPKBitbase, KPKBitbase + Words));
+}
+
+
+/// Bitbases::load() makes the KBPK and KRKP bitbases available, or releases them.
+/// Their generation takes a few seconds of the given threads, so the bitbases
+/// are cached in the given directory, if any. KBPK needs the KPK bitbase.
+
+void Bitbases::load(bool enabled, const std::string& path, size_t threads) {
+
+  KBPKBitbase.clear();
+  KRKPBitbase.clear();
+
+  if (enabled)
+  {
+      KBPKBitbase = load_or_generate<KBPKPosition>("KBPK", path, threads);
+      KRKPBitbase = load_or_generate<KRKPPosition>("KRKP", path, threads);
+  }
+}
+
+
+/// Bitbases::generate() classifies all the KPK positions by retrograde analysis,
+/// and returns the bitbase as words of 64 bits. It is used to generate tables.h.
+
+std::vector<uint64_t> Bitbases::generate() {
+
+  return retrograde<KPKPosition>(1);
 }
 
 namespace {
@@ -121,19 +396,7 @@ namespace {
         result = UNKNOWN;
   }
 
-  Result KPKPosition::classify(const std::vector<KPKPosition>& db) {
-
-    // White to move: If one move leads to a position classified as WIN, the result
-    // of the current position is WIN. If all moves lead to positions classified
-    // as DRAW, the current position is classified as DRAW, otherwise the current
-    // position is classified as UNKNOWN.
-    //
-    // Black to move: If one move leads to a position classified as DRAW, the result
-    // of the current position is DRAW. If all moves lead to positions classified
-    // as WIN, the position is classified as WIN, otherwise the current position is
-    // classified as UNKNOWN.
-    const Result Good = (stm == WHITE ? WIN   : DRAW);
-    const Result Bad  = (stm == WHITE ? DRAW  : WIN);
+  Result KPKPosition::moves(const Results& db) const {
 
     Result r = INVALID;
     Bitboard b = attacks_bb<KING>(ksq[stm]);
@@ -153,7 +416,227 @@ namespace {
             r |= db[index(BLACK, ksq[BLACK], ksq[WHITE], psq + NORTH + NORTH)];
     }
 
-    return result = r & Good  ? Good  : r & UNKNOWN ? UNKNOWN : Bad;
+    return r;
+  }
+
+
+  KBPKPosition::KBPKPosition(unsigned idx) {
+
+    wksq = Square((idx >>  0) & 0x3F);
+    bksq = Square((idx >>  6) & 0x3F);
+    bsq  = Square((idx >> 12) & 0x3F);
+    stm  = Color ((idx >> 18) & 0x01);
+    psq  = make_square(FILE_A, Rank(RANK_7 - ((idx >> 19) & 0x7)));
+
+    occupied = square_bb(wksq) | bksq | bsq | psq;
+
+    // Squares attacked by white, seen through the black king
+    attacked =  attacks_bb<KING>(wksq) | pawn_attacks_bb(WHITE, psq)
+              | attacks_bb<BISHOP>(bsq, occupied ^ bksq);
+
+    // Invalid if two pieces are on the same square or if a king can be captured
+    if (   popcount(occupied) < 4
+        || distance(wksq, bksq) <= 1
+        || (stm == WHITE && (attacked & bksq)))
+        result = INVALID;
+
+    // Mate or stalemate
+    else if (stm == BLACK && !(attacks_bb<KING>(bksq) & ~attacked))
+        result = attacked & bksq ? WIN : DRAW;
+
+    // Position will be classified later
+    else
+        result = UNKNOWN;
+  }
+
+  // The pawn promotes to the given piece, with black to move: the ending is won
+  // unless black can capture the new piece or is stalemated.
+  Result KBPKPosition::promotion(PieceType pt) const {
+
+    const Square to = psq + NORTH;
+    const Bitboard occ = occupied ^ psq ^ to ^ bksq;
+    const Bitboard covered =  attacks_bb<KING>(wksq) | attacks_bb<BISHOP>(bsq, occ)
+                            | attacks_bb(pt, to, occ);
+    const Bitboard evasions = attacks_bb<KING>(bksq) & ~covered;
+
+    return (evasions & to) || !(evasions || (covered & bksq)) ? DRAW : WIN;
+  }
+
+  Result KBPKPosition::moves(const Results& db) const {
+
+    Result r = INVALID;
+
+    if (stm == WHITE)
+    {
+        Bitboard b = attacks_bb<KING>(wksq) & ~occupied & ~attacks_bb<KING>(bksq);
+        while (b)
+            r |= db[kbpk_index(BLACK, pop_lsb(b), bksq, bsq, psq)];
+
+        b = attacks_bb<BISHOP>(bsq, occupied) & ~occupied;
+        while (b)
+            r |= db[kbpk_index(BLACK, wksq, bksq, pop_lsb(b), psq)];
+
+        const Square push = psq + NORTH;
+
+        if (!(occupied & push))
+        {
+            if (rank_of(psq) == RANK_7)
+                r |= promotion(QUEEN) == WIN ? WIN : promotion(ROOK);
+            else
+            {
+                r |= db[kbpk_index(BLACK, wksq, bksq, bsq, push)];
+
+                if (rank_of(psq) == RANK_2 && !(occupied & (push + NORTH)))
+                    r |= db[kbpk_index(BLACK, wksq, bksq, bsq, push + NORTH)];
+            }
+        }
+    }
+    else
+    {
+        Bitboard b = attacks_bb<KING>(bksq) & ~attacked;
+        while (b)
+        {
+            const Square to = pop_lsb(b);
+
+            r |= to == psq ? DRAW
+               : to == bsq ? (Bitbases::probe(wksq, psq, to, WHITE) ? WIN : DRAW)
+                           : db[kbpk_index(WHITE, wksq, to, bsq, psq)];
+        }
+    }
+
+    return r;
+  }
+
+
+  KRKPPosition::KRKPPosition(unsigned idx) {
+
+    wksq = Square((idx >>  0) & 0x3F);
+    bksq = Square((idx >>  6) & 0x3F);
+    rsq  = Square((idx >> 12) & 0x3F);
+    stm  = Color ((idx >> 18) & 0x01);
+    psq  = make_square(File((idx >> 19) & 0x3), Rank(RANK_2 + ((idx >> 21) & 0x7)));
+
+    occupied = square_bb(wksq) | bksq | rsq | psq;
+
+    // Squares attacked by white, seen through the black king
+    attacked = attacks_bb<KING>(wksq) | attacks_bb<ROOK>(rsq, occupied ^ bksq);
+
+    // Invalid if two pieces are on the same square or if a king can be captured
+    if (   popcount(occupied) < 4
+        || distance(wksq, bksq) <= 1
+        || (stm == WHITE && (attacked & bksq))
+        || (stm == BLACK && (pawn_attacks_bb(BLACK, psq) & wksq)))
+        result = INVALID;
+
+    // Mate or stalemate
+    else if (stm == BLACK && !(attacks_bb<KING>(bksq) & ~attacked & ~square_bb(psq)) && !pawn_moves())
+        result = attacked & bksq ? WIN : DRAW;
+
+    // Position will be classified later
+    else
+        result = UNKNOWN;
+  }
+
+  // Legal moves of the black pawn, pushes and capture of the rook
+  Bitboard KRKPPosition::pawn_moves() const {
+
+    const Square push = psq + SOUTH;
+    Bitboard b = pawn_attacks_bb(BLACK, psq) & rsq;
+
+    if (!(occupied & push))
+    {
+        b |= push;
+
+        if (rank_of(psq) == RANK_7 && !(occupied & (push + SOUTH)))
+            b |= push + SOUTH;
+    }
+
+    // Unless the rook is captured, the pawn must not leave the king in check
+    Bitboard legal = b & rsq;
+    for (b &= ~square_bb(rsq); b; )
+    {
+        const Square to = pop_lsb(b);
+        if (!(attacks_bb<ROOK>(rsq, occupied ^ psq ^ to) & bksq))
+            legal |= to;
+    }
+
+    return legal;
+  }
+
+  // White captures the pawn, leaving its king and rook on the given squares,
+  // with black to move: KRK is won unless black can capture the rook or is
+  // stalemated.
+  Result KRKPPosition::krk(Square ksq, Square rook) const {
+
+    const Bitboard covered = attacks_bb<KING>(ksq) | attacks_bb<ROOK>(rook, square_bb(ksq) | rook);
+    const Bitboard evasions = attacks_bb<KING>(bksq) & ~covered;
+
+    return (evasions & rook) || !(evasions || (covered & bksq)) ? DRAW : WIN;
+  }
+
+  // The pawn promotes on the given square, with white to move: whatever the new
+  // piece, the ending is won only if white captures it at once, with the rook
+  // or with the king, reaching a won KRK.
+  Result KRKPPosition::promotion(Square to) const {
+
+    Result r = DRAW;
+
+    if (attacks_bb<ROOK>(rsq, occupied ^ psq ^ to) & to)
+        r = krk(wksq, to);
+
+    if (r != WIN && (attacks_bb<KING>(wksq) & ~attacks_bb<KING>(bksq) & to))
+        r = krk(to, rsq);
+
+    return r;
+  }
+
+  Result KRKPPosition::moves(const Results& db) const {
+
+    Result r = INVALID;
+
+    if (stm == WHITE)
+    {
+        Bitboard b = attacks_bb<KING>(wksq) & ~square_bb(rsq) & ~attacks_bb<KING>(bksq) & ~pawn_attacks_bb(BLACK, psq);
+        while (b)
+        {
+            const Square to = pop_lsb(b);
+            r |= to == psq ? krk(to, rsq) : db[krkp_index(BLACK, to, bksq, rsq, psq)];
+        }
+
+        // When the pawn gives check, the rook can only capture it
+        b = attacks_bb<ROOK>(rsq, occupied) & ~square_bb(wksq) & ~square_bb(bksq);
+        if (pawn_attacks_bb(BLACK, psq) & wksq)
+            b &= square_bb(psq);
+
+        while (b)
+        {
+            const Square to = pop_lsb(b);
+            r |= to == psq ? krk(wksq, to) : db[krkp_index(BLACK, wksq, bksq, to, psq)];
+        }
+    }
+    else
+    {
+        // The capture of the rook is a draw, as white cannot win KPK. So is a
+        // promotion unless white captures the new piece at once: but for rare
+        // exceptions, white does not win KRKQ, KRKR, KRKB or KRKN.
+        Bitboard b = attacks_bb<KING>(bksq) & ~attacked & ~square_bb(psq);
+        while (b)
+        {
+            const Square to = pop_lsb(b);
+            r |= to == rsq ? DRAW : db[krkp_index(WHITE, wksq, to, rsq, psq)];
+        }
+
+        b = pawn_moves();
+        while (b)
+        {
+            const Square to = pop_lsb(b);
+            r |= to == rsq              ? DRAW
+               : rank_of(to) == RANK_1 ? promotion(to)
+                                        : db[krkp_index(WHITE, wksq, bksq, rsq, to)];
+        }
+    }
+
+    return r;
   }
 
 } // namespace
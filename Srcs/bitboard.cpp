@@ -10,6 +10,7 @@
 
 #include "bitboard.h"
 #include "misc.h"
+#include "tables.h"
 
 namespace Stockfish {
 
@@ -30,7 +31,7 @@ namespace {
   Bitboard RookTable[0x19000];  // To store rook attacks
   Bitboard BishopTable[0x1480]; // To store bishop attacks
 
-  void init_magics(PieceType pt, Bitboard table[], Magic magics[]);
+  void init_magics(PieceType pt, Bitboard table[], Magic magics[], const Bitboard magicNumbers[]);
 
 }
 
@@ -78,8 +79,8 @@ void Bitboards::init() {
       for (Square s2 = SQ_A1; s2 <= SQ_H8; ++s2)
           SquareDistance[s1][s2] = std::max(distance<File>(s1, s2), distance<Rank>(s1, s2));
 
-  init_magics(ROOK, RookTable, RookMagics);
-  init_magics(BISHOP, BishopTable, BishopMagics);
+  init_magics(ROOK, RookTable, RookMagics, Tables::RookMagicNumbers[Is64Bit]);
+  init_magics(BISHOP, BishopTable, BishopMagics, Tables::BishopMagicNumbers[Is64Bit]);
 
   for (Square s1 = SQ_A1; s1 <= SQ_H8; ++s1)
   {
@@ -127,85 +128,138 @@ namespace {
   }
 
 
+  // relevant_occupancies() returns the squares whose occupancy matters for the
+  // attacks of a slider on the given square. Board edges are not considered,
+  // unless the slider is on them.
+
+  Bitboard relevant_occupancies(PieceType pt, Square s) {
+
+    Bitboard edges = ((Rank1BB | Rank8BB) & ~rank_bb(s)) | ((FileABB | FileHBB) & ~file_bb(s));
+
+    return sliding_attack(pt, s, 0) & ~edges;
+  }
+
+
+  // magic_index() is Magic::index() without pext, for the magics of 64-bit or
+  // of 32-bit builds, so that the magics of both can be searched by any build.
+
+  unsigned magic_index(Bitboard occupied, Bitboard mask, Bitboard magic, bool is64Bit) {
+
+    unsigned shift = (is64Bit ? 64 : 32) - popcount(mask);
+
+    if (is64Bit)
+        return unsigned(((occupied & mask) * magic) >> shift);
+
+    unsigned lo = unsigned(occupied) & unsigned(mask);
+    unsigned hi = unsigned(occupied >> 32) & unsigned(mask >> 32);
+    return (lo * unsigned(magic) ^ hi * unsigned(magic >> 32)) >> shift;
+  }
+
+
   // init_magics() computes all rook and bishop attacks at startup. Magic
   // bitboards are used to look up attacks of sliding pieces. As a reference see
   // www.chessprogramming.org/Magic_Bitboards. In particular, here we use the so
-  // called "fancy" approach.
-
-  void init_magics(PieceType pt, Bitboard table[], Magic magics[]) {
+  // called "fancy" approach. The magics come from tables.h: filling the table
+  // verifies them, and the magic of a square is searched again if it fails.
 
-    // Optimal PRNG seeds to pick the correct magics in the shortest time
-    int seeds[][RANK_NB] = { { 8977, 44560, 54343, 38998,  5731, 95205, 104912, 17020 },
-                             {  728, 10316, 55013, 32803, 12281, 15100,  16645,   255 } };
+  void init_magics(PieceType pt, Bitboard table[], Magic magics[], const Bitboard magicNumbers[]) {
 
-    Bitboard occupancy[4096], reference[4096], edges, b;
-    int epoch[4096] = {}, cnt = 0, size = 0;
+    int size = 0;
 
     for (Square s = SQ_A1; s <= SQ_H8; ++s)
     {
-        // Board edges are not considered in the relevant occupancies
-        edges = ((Rank1BB | Rank8BB) & ~rank_bb(s)) | ((FileABB | FileHBB) & ~file_bb(s));
-
         // Given a square 's', the mask is the bitboard of sliding attacks from
         // 's' computed on an empty board. The index must be big enough to contain
         // all the attacks for each possible subset of the mask and so is 2 power
         // the number of 1s of the mask. Hence we deduce the size of the shift to
         // apply to the 64 or 32 bits word to get the index.
         Magic& m = magics[s];
-        m.mask  = sliding_attack(pt, s, 0) & ~edges;
+        m.mask  = relevant_occupancies(pt, s);
         m.shift = (Is64Bit ? 64 : 32) - popcount(m.mask);
+        m.magic = magicNumbers[s];
 
         // Set the offset for the attacks table of the square. We have individual
         // table sizes for each square with "Fancy Magic Bitboards".
         m.attacks = s == SQ_A1 ? table : magics[s - 1].attacks + size;
+        size = 1 << popcount(m.mask);
 
-        // Use Carry-Rippler trick to enumerate all subsets of masks[s] and
-        // store the corresponding sliding attack bitboard in reference[].
-        b = size = 0;
-        do {
-            occupancy[size] = b;
-            reference[size] = sliding_attack(pt, s, b);
-
-            if (HasPext)
-                m.attacks[pext(b, m.mask)] = reference[size];
-
-            size++;
-            b = (b - m.mask) & m.mask;
-        } while (b);
-
-        if (HasPext)
-            continue;
-
-        PRNG rng(seeds[Is64Bit][rank_of(s)]);
-
-        // Find a magic for square 's' picking up an (almost) random number
-        // until we find the one that passes the verification test.
-        for (int i = 0; i < size; )
+        for (bool verified = false; !verified; )
         {
-            for (m.magic = 0; popcount((m.magic * m.mask) >> 56) < 6; )
-                m.magic = rng.sparse_rand<Bitboard>();
-
-            // A good magic must map every possible occupancy to an index that
-            // looks up the correct sliding attack in the attacks[s] database.
-            // Note that we build up the database for square 's' as a side
-            // effect of verifying the magic. Keep track of the attempt count
-            // and save it in epoch[], little speed-up trick to avoid resetting
-            // m.attacks[] after every failed attempt.
-            for (++cnt, i = 0; i < size; ++i)
+            // Use Carry-Rippler trick to enumerate all subsets of masks[s] and
+            // store the corresponding sliding attack bitboards. The table is
+            // zeroed, and an attack is never empty, so a collision shows as a
+            // different attack already stored at the index.
+            Bitboard b = 0;
+            verified = true;
+            do {
+                Bitboard attacks = sliding_attack(pt, s, b);
+                Bitboard& entry = m.attacks[m.index(b)];
+
+                verified &= !entry || entry == attacks;
+                entry = attacks;
+                b = (b - m.mask) & m.mask;
+            } while (b);
+
+            if (!verified)
             {
-                unsigned idx = m.index(occupancy[i]);
-
-                if (epoch[idx] < cnt)
-                {
-                    epoch[idx] = cnt;
-                    m.attacks[idx] = reference[i];
-                }
-                else if (m.attacks[idx] != reference[i])
-                    break;
+                std::fill(m.attacks, m.attacks + size, 0);
+                m.magic = Bitboards::find_magic(pt, s, Is64Bit);
             }
         }
     }
   }
 }
 
+
+/// Bitboards::find_magic() searches the magic of a slider on a square for the
+/// 64-bit or the 32-bit builds, picking up (almost) random numbers until one
+/// maps every possible occupancy to an index of the correct sliding attack.
+/// This is how init() used to find all the magics at startup: now 'make tables'
+/// runs it to generate tables.h, which init() only has to verify.
+
+Bitboard Bitboards::find_magic(PieceType pt, Square s, bool is64Bit) {
+
+  // Optimal PRNG seeds to pick the correct magics in the shortest time
+  int seeds[][RANK_NB] = { { 8977, 44560, 54343, 38998,  5731, 95205, 104912, 17020 },
+                           {  728, 10316, 55013, 32803, 12281, 15100,  16645,   255 } };
+
+  Bitboard occupancy[4096], reference[4096], attacks[4096], magic = 0;
+  Bitboard mask = relevant_occupancies(pt, s);
+  int epoch[4096] = {}, cnt = 0, size = 0;
+
+  // Store the sliding attack of each subset of the mask in reference[]
+  Bitboard b = 0;
+  do {
+      occupancy[size] = b;
+      reference[size++] = sliding_attack(pt, s, b);
+      b = (b - mask) & mask;
+  } while (b);
+
+  PRNG rng(seeds[is64Bit][rank_of(s)]);
+
+  for (int i = 0; i < size; )
+  {
+      for (magic = 0; popcount((magic * mask) >> 56) < 6; )
+          magic = rng.sparse_rand<Bitboard>();
+
+      // Build up the attacks of the candidate, keeping track of the attempt
+      // count in epoch[], little speed-up trick to avoid resetting attacks[]
+      // after every failed attempt.
+      for (++cnt, i = 0; i < size; ++i)
+      {
+          unsigned idx = magic_index(occupancy[i], mask, magic, is64Bit);
+
+          if (epoch[idx] < cnt)
+          {
+              epoch[idx] = cnt;
+              attacks[idx] = reference[i];
+          }
+          else if (attacks[idx] != reference[i])
+              break;
+      }
+  }
+
+  return magic;
+}
+
 } // namespace Stockfish
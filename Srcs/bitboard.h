@@ -9,6 +9,7 @@
 #define BITBOARD_H_INCLUDED
 
 #include <string>
+#include <vector>
 
 #include "types.h"
 
@@ -17,13 +18,19 @@ namespace Stockfish {
 namespace Bitbases {
 
 void init();
+void load(bool enabled, const std::string& path, size_t threads);
+std::vector<uint64_t> generate();
+bool available();
 bool probe(Square wksq, Square wpsq, Square bksq, Color us);
+bool probe_kbpk(Square wksq, Square wbsq, Square wpsq, Square bksq, Color us);
+bool probe_krkp(Square wksq, Square wrsq, Square bksq, Square bpsq, Color us);
 
 } // namespace Stockfish::Bitbases
 
 namespace Bitboards {
 
 void init();
+Bitboard find_magic(PieceType pt, Square s, bool is64Bit);
 std::string pretty(Bitboard b);
 
 } // namespace Stockfish::Bitboards
@@ -6,9 +6,14 @@
 */
 
 #include <cassert>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <unordered_map>
 
 #include "bitboard.h"
 #include "endgame.h"
+#include "misc.h"
 #include "movegen.h"
 
 namespace Stockfish {
@@ -56,10 +61,54 @@ namespace {
 
 namespace Endgames {
 
-  std::pair<Map<Value>, Map<ScaleFactor>> maps;
+  std::pair<Table<Value>, Table<ScaleFactor>> tables;
+
+  /// Table::build() places the endgames in the smallest table, at least twice
+  /// as large as their number, where some bits of their keys tell them apart.
+  /// The keys are distinct, see add(), so that the search ends long before
+  /// MaxBits for any realistic number of endgames.
+
+  template<typename T>
+  void Table<T>::build() {
+
+    constexpr unsigned MaxBits = 16;
+
+    unsigned bits = 1;
+    while ((size_t(1) << bits) < 2 * endgames.size())
+        ++bits;
+
+    for ( ; bits <= MaxBits; ++bits)
+        for (shift = 0; shift + bits <= 64; ++shift)
+        {
+            const size_t size = size_t(1) << bits;
+            mask = size - 1;
+            slots.assign(size, Slot{ 0, nullptr });
+
+            bool perfect = true;
+            for (const auto& [key, endgame] : endgames)
+            {
+                Slot& slot = slots[(key >> shift) & mask];
+                if (slot.endgame)
+                {
+                    perfect = false;
+                    break;
+                }
+                slot = { key, endgame.get() };
+            }
+
+            if (perfect)
+                return;
+        }
+
+    std::cerr << "Failed to place the endgames in a table of 2^" << MaxBits << " slots." << std::endl;
+    exit(EXIT_FAILURE);
+  }
 
   void init() {
 
+    table<Value>().endgames.clear();
+    table<ScaleFactor>().endgames.clear();
+
     add<KPK>("KPK");
     add<KNNK>("KNNK");
     add<KBNK>("KBNK");
@@ -76,6 +125,67 @@ namespace Endgames {
     add<KBPKN>("KBPKN");
     add<KBPPKB>("KBPPKB");
     add<KRPPKRP>("KRPPKRP");
+
+    table<Value>().build();
+    table<ScaleFactor>().build();
+  }
+
+  /// benchmark() times the probes of the endgame tables, done by Material::probe()
+  /// on every material table miss, against the same lookups in std::unordered_map,
+  /// which held the endgames before. The keys are those of the endgames mixed
+  /// with random keys, for the misses, which are far more frequent in a search.
+
+  void benchmark(int repeats) {
+
+    constexpr size_t KeyCount = 4096;
+
+    std::unordered_map<Key, const EndgameBase<Value>*> valueMap;
+    std::unordered_map<Key, const EndgameBase<ScaleFactor>*> scaleMap;
+    std::vector<Key> keys;
+
+    for (const auto& [key, endgame] : table<Value>().endgames)
+        valueMap[key] = endgame.get(), keys.push_back(key);
+
+    for (const auto& [key, endgame] : table<ScaleFactor>().endgames)
+        scaleMap[key] = endgame.get(), keys.push_back(key);
+
+    PRNG rng(1070372);
+    while (keys.size() < KeyCount)
+        keys.push_back(rng.rand<Key>());
+
+    for (size_t i = keys.size() - 1; i > 0; --i)
+        std::swap(keys[i], keys[rng.rand<size_t>() % (i + 1)]);
+
+    size_t found[2] = {};
+    TimePoint elapsed[2];
+
+    for (int method : { 0, 1 })
+    {
+        TimePoint start = now();
+
+        for (int r = 0; r < repeats; ++r)
+            for (Key key : keys)
+            {
+                if (method == 0)
+                    found[0] += (probe<Value>(key) != nullptr) + (probe<ScaleFactor>(key) != nullptr);
+                else
+                {
+                    auto v = valueMap.find(key);
+                    auto sf = scaleMap.find(key);
+                    found[1] += (v != valueMap.end() && v->second) + (sf != scaleMap.end() && sf->second);
+                }
+            }
+
+        elapsed[method] = now() - start + 1; // Ensure positivity to avoid a 'divide by zero'
+    }
+
+    const double probes = 2.0 * KeyCount * std::max(repeats, 1);
+
+    sync_cout << "Probes per table   : " << uint64_t(probes / 2)
+              << "\nFound             : " << found[0] << " (map " << found[1] << ")"
+              << std::fixed << std::setprecision(2)
+              << "\nFlat table (ns)    : " << 1e6 * elapsed[0] / probes
+              << "\nUnordered map (ns) : " << 1e6 * elapsed[1] / probes << sync_endl;
   }
 }
 
@@ -163,7 +273,8 @@ Value Endgame<KPK>::operator()(const Position& pos) const {
 /// KR vs KP. This is a somewhat tricky endgame to evaluate precisely without
 /// a bitbase. The function below returns drawish scores when the pawn is
 /// far advanced with support of the king, while the attacking king is far
-/// away.
+/// away. With the optional bitbase, the wins are known, but for rare ones
+/// after a promotion, and the scores below only help to make progress.
 template<>
 Value Endgame<KRKP>::operator()(const Position& pos) const {
 
@@ -175,7 +286,24 @@ Value Endgame<KRKP>::operator()(const Position& pos) const {
   Square strongRook = pos.square<ROOK>(strongSide);
   Square weakPawn   = pos.square<PAWN>(weakSide);
   Square queeningSquare = make_square(file_of(weakPawn), relative_rank(weakSide, RANK_8));
-  Value result;
+  Value result, bonus = VALUE_ZERO;
+
+  if (Bitbases::available())
+  {
+      // Assume strongSide is white and the pawn is on files A-D
+      auto normalized = [&](Square s) {
+          s = file_of(weakPawn) >= FILE_E ? flip_file(s) : s;
+          return strongSide == WHITE ? s : flip_rank(s);
+      };
+
+      Color us = strongSide == pos.side_to_move() ? WHITE : BLACK;
+
+      if (!Bitbases::probe_krkp(normalized(strongKing), normalized(strongRook),
+                                normalized(weakKing), normalized(weakPawn), us))
+          return VALUE_DRAW;
+
+      bonus = VALUE_KNOWN_WIN;
+  }
 
   // If the stronger side's king is in front of the pawn, it's a win
   if (forward_file_bb(strongSide, strongKing) & weakPawn)
@@ -200,6 +328,8 @@ Value Endgame<KRKP>::operator()(const Position& pos) const {
                                   - distance(weakKing, weakPawn + pawn_push(weakSide))
                                   - distance(weakPawn, queeningSquare));
 
+  result += bonus;
+
   return strongSide == pos.side_to_move() ? result : -result;
 }
 
@@ -322,6 +452,25 @@ ScaleFactor Endgame<KBPsK>::operator()(const Position& pos) const {
   Square weakKing = pos.square<KING>(weakSide);
   Square strongKing = pos.square<KING>(strongSide);
 
+  // With a single rook pawn against the bare king, the optional bitbase
+  // knows the result, assuming strongSide is white and the pawn on file A.
+  if (   Bitbases::available()
+      && pos.count<ALL_PIECES>() == 4
+      && pos.count<PAWN>(strongSide) == 1
+      && (strongPawns & (FileABB | FileHBB)))
+  {
+      auto normalized = [&](Square s) {
+          s = strongPawns & FileHBB ? flip_file(s) : s;
+          return strongSide == WHITE ? s : flip_rank(s);
+      };
+
+      Color us = strongSide == pos.side_to_move() ? WHITE : BLACK;
+
+      return Bitbases::probe_kbpk(normalized(strongKing), normalized(strongBishop),
+                                  normalized(lsb(strongPawns)), normalized(weakKing), us)
+            ? SCALE_FACTOR_NONE : SCALE_FACTOR_DRAW;
+  }
+
   // All strongSide pawns are on a single rook file?
   if (!(strongPawns & ~FileABB) || !(strongPawns & ~FileHBB))
   {
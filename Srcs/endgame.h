@@ -8,11 +8,12 @@
 #ifndef ENDGAME_H_INCLUDED
 #define ENDGAME_H_INCLUDED
 
+#include <algorithm>
 #include <memory>
 #include <string>
 #include <type_traits>
-#include <unordered_map>
 #include <utility>
+#include <vector>
 
 #include "position.h"
 #include "types.h"
@@ -78,35 +79,68 @@ struct Endgame : public EndgameBase<T> {
 
 
 /// The Endgames namespace handles the pointers to endgame evaluation and scaling
-/// base objects in two std::map. We use polymorphism to invoke the actual
+/// base objects in two tables. We use polymorphism to invoke the actual
 /// endgame function by calling its virtual operator().
 
 namespace Endgames {
 
   template<typename T> using Ptr = std::unique_ptr<EndgameBase<T>>;
-  template<typename T> using Map = std::unordered_map<Key, Ptr<T>>;
 
-  extern std::pair<Map<Value>, Map<ScaleFactor>> maps;
+  // Flat table of the endgames of a type, indexed by some bits of the material
+  // key. build() picks the bits so that no two endgames share a slot, so that
+  // a probe reads a single slot, also for a miss, which is the common case.
+  template<typename T>
+  struct Table {
+
+    struct Slot {
+      Key key;
+      const EndgameBase<T>* endgame;
+    };
+
+    void build();
+
+    std::vector<std::pair<Key, Ptr<T>>> endgames;
+    std::vector<Slot> slots;
+    unsigned shift;
+    Key mask;
+  };
+
+  extern std::pair<Table<Value>, Table<ScaleFactor>> tables;
 
   void init();
+  void benchmark(int repeats);
 
   template<typename T>
-  Map<T>& map() {
-    return std::get<std::is_same<T, ScaleFactor>::value>(maps);
+  Table<T>& table() {
+    return std::get<std::is_same<T, ScaleFactor>::value>(tables);
   }
 
   template<EndgameCode E, typename T = eg_type<E>>
   void add(const std::string& code) {
 
     StateInfo st;
-    map<T>()[Position().set(code, WHITE, &st).material_key()] = Ptr<T>(new Endgame<E>(WHITE));
-    map<T>()[Position().set(code, BLACK, &st).material_key()] = Ptr<T>(new Endgame<E>(BLACK));
+
+    for (Color c : { WHITE, BLACK })
+    {
+        const Key key = Position().set(code, c, &st).material_key();
+        auto& endgames = table<T>().endgames;
+
+        // The last endgame added for a key wins, as both colors of a symmetric
+        // endgame give the same key, and build() needs distinct keys.
+        auto it = std::find_if(endgames.begin(), endgames.end(), [key](const auto& e) { return e.first == key; });
+
+        if (it != endgames.end())
+            it->second = Ptr<T>(new Endgame<E>(c));
+        else
+            endgames.emplace_back(key, Ptr<T>(new Endgame<E>(c)));
+    }
   }
 
   template<typename T>
   const EndgameBase<T>* probe(Key key) {
-    auto it = map<T>().find(key);
-    return it != map<T>().end() ? it->second.get() : nullptr;
+    const Table<T>& t = table<T>();
+    const auto& slot = t.slots[(key >> t.shift) & t.mask];
+    return slot.key == key ? slot.endgame : nullptr;
   }
 }
 
@@ -7,12 +7,16 @@
 
 #include <algorithm>
 #include <cassert>
+#include <chrono>
 #include <cstdlib>
 #include <cstring>   // For std::memset
 #include <fstream>
 #include <iomanip>
 #include <sstream>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <new>
 #include <streambuf>
 #include <vector>
 
@@ -20,11 +24,13 @@
 #include "evaluate.h"
 #include "material.h"
 #include "misc.h"
+#include "movegen.h"
 #include "pawns.h"
 #include "thread.h"
 #include "timeman.h"
 #include "uci.h"
 #include "incbin/incbin.h"
+#include "nnue/evaluate_nnue.h"
 
 
 // Macro to embed the default efficiently updatable neural network (NNUE) file
@@ -35,7 +41,11 @@
 //     const unsigned int         gEmbeddedNNUESize;    // the size of the embedded file
 // Note that this does not work in Microsoft Visual Studio.
 #if !defined(_MSC_VER) && !defined(NNUE_EMBEDDING_OFF)
+  #if defined(NNUE_EMBEDDING_EXTERN)
+  INCBIN_EXTERN(EmbeddedNNUE); // Embedded once by the entry point of the fat binary
+  #else
   INCBIN(EmbeddedNNUE, EvalFileDefaultName);
+  #endif
 #else
   const unsigned char        gEmbeddedNNUEData[1] = {0x0};
   const unsigned char *const gEmbeddedNNUEEnd = &gEmbeddedNNUEData[1];
@@ -47,6 +57,688 @@ using namespace std;
 
 namespace Stockfish {
 
+namespace Eval::NNUE {
+
+  // A net of any architecture, with the entry points of the evaluation. The
+  // architecture of a net is dispatched once, when the net is read, by creating
+  // the BasicNet of the architecture given by the hash value of its header.
+  struct Net {
+
+    virtual ~Net() = default;
+
+    virtual Value evaluate(const Position& pos, bool adjusted) const = 0;
+    virtual void evaluate_by_bucket(const Position* const* positions, Value* values, size_t count) const = 0;
+    virtual void prefetch(const Position& pos) const = 0;
+    virtual void benchmark(Position* const* positions, size_t count, int iterations) const = 0;
+    virtual string trace(Position& pos) const = 0;
+
+    virtual bool read(istream& stream, const string& imageFile) = 0;
+    virtual bool write(ostream& stream) const = 0;
+
+    // Copy of the net, or null if it cannot be allocated. The memory of the
+    // copy is allocated and first written by the calling thread, so on systems
+    // with a first-touch policy it belongs to the NUMA node of that thread.
+    virtual unique_ptr<Net> copy() const = 0;
+
+    // Make the thread claim the accumulators of the architecture of the net
+    virtual void use_accumulators(ThreadAccumulators& accumulators) const = 0;
+
+    virtual IndexType dimensions() const = 0;
+  };
+
+  namespace {
+
+  template <typename T>
+  bool read_parameters(istream& stream, T& reference) {
+    uint32_t header = read_little_endian<uint32_t>(stream);
+    return stream && header == T::get_hash_value() && reference.read_parameters(stream);
+  }
+
+  template <typename T>
+  bool write_parameters(ostream& stream, const T& reference) {
+    write_little_endian<uint32_t>(stream, T::get_hash_value());
+    return reference.write_parameters(stream);
+  }
+
+  // Name of the SIMD instruction set the NNUE kernels were compiled for
+  const char* simd_name() {
+  #if defined(USE_VNNI) && defined(USE_AVX512)
+    return "vnni512";
+  #elif defined(USE_VNNI)
+    return "vnni256";
+  #elif defined(USE_AVX512)
+    return "avx512";
+  #elif defined(USE_AVX2)
+    return "avx2";
+  #elif defined(USE_SSSE3)
+    return "ssse3";
+  #elif defined(USE_SSE2)
+    return "sse2";
+  #elif defined(USE_MMX)
+    return "mmx";
+  #elif defined(USE_NEON)
+    return "neon";
+  #else
+    return "generic";
+  #endif
+  }
+
+  // Time the kernels of the evaluation one at a time, each of them 'iterations'
+  // times in a row on every position, and print for each one the mean time and
+  // the mean number of bytes of parameters and accumulators it touches per call.
+  // The byte counts are derived from the features of the positions: a weight
+  // row, with its PSQT row, is as large as one perspective of an accumulator.
+  template <typename Arch>
+  void time_kernels(const BasicFeatureTransformer<Arch>& transformer,
+                    const AlignedPtr<typename Arch::Network>* networks,
+                    Position* const* positions, size_t count, int iterations) {
+
+    using Clock = std::chrono::steady_clock;
+    using IndexList = ValueList<IndexType, FeatureSet::MaxActiveDimensions>;
+
+    constexpr double RowBytes =  Arch::TransformedFeatureDimensions * sizeof(int16_t)
+                               + Arch::PSQTBuckets * sizeof(int32_t);
+    constexpr double TransformedBytes = BasicFeatureTransformer<Arch>::OutputDimensions;
+
+    alignas(CacheLineSize) TransformedFeatureType transformedFeatures[BasicFeatureTransformer<Arch>::BufferSize];
+    alignas(CacheLineSize) char buffer[Arch::Network::BufferSize];
+
+    enum Kernel { Refresh, Update, Transform, Propagate, KERNEL_NB };
+    const char* KernelNames[KERNEL_NB] = { "refresh", "update", "transform", "propagate" };
+
+    double ns[KERNEL_NB] = {}, bytes[KERNEL_NB] = {};
+    uint64_t calls[KERNEL_NB] = {};
+    volatile int32_t sink;
+
+    auto time = [&](Kernel k, double bytesPerCall, const auto& kernel) {
+
+        const auto start = Clock::now();
+        for (int i = 0; i < iterations; ++i)
+            kernel();
+        ns[k] += std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+        bytes[k] += bytesPerCall * iterations;
+        calls[k] += iterations;
+    };
+
+    for (size_t n = 0; n < count; ++n)
+    {
+        Position& pos = *positions[n];
+        const size_t bucket = (pos.count<ALL_PIECES>() - 1) / 4;
+        size_t active = 0, changed = 0;
+
+        for (Color perspective : { WHITE, BLACK })
+        {
+            IndexList list;
+            FeatureSet::append_active_indices(pos, perspective, list);
+            active += list.size();
+        }
+
+        // Biases and active rows read, refresh entry and accumulator written
+        time(Refresh, (active + 6) * RowBytes, [&]() { transformer.refresh_from_biases(pos); });
+
+        // Accumulators of both perspectives read, transformed features written
+        time(Transform, 2 * RowBytes + TransformedBytes, [&]() {
+            sink = transformer.transform(pos, transformedFeatures, bucket);
+        });
+
+        // Whole layer stack read, upper bound for the sparse first layer
+        time(Propagate, sizeof(typename Arch::Network) + TransformedBytes + Arch::Network::BufferSize, [&]() {
+            sink = networks[bucket]->propagate(transformedFeatures, buffer)[0];
+        });
+
+        // The accumulators of the position are computed, so after a move which
+        // is not a king move both perspectives are updated incrementally.
+        for (const auto& m : MoveList<LEGAL>(pos))
+            if (type_of(pos.moved_piece(m)) != KING)
+            {
+                StateInfo st;
+                pos.do_move(m, st);
+
+                for (Color perspective : { WHITE, BLACK })
+                {
+                    IndexList removed, added;
+                    FeatureSet::append_changed_indices(
+                      pos.square<KING>(perspective), pos.state(), perspective, removed, added);
+                    changed += removed.size() + added.size();
+                }
+
+                // Changed rows read, source and target accumulators read and written
+                time(Update, (changed + 4) * RowBytes, [&]() { transformer.update_from_previous(pos); });
+
+                pos.undo_move(m);
+                break;
+            }
+    }
+
+    for (int k = 0; k < KERNEL_NB; ++k)
+        sync_cout << "nnuebench kernel=" << KernelNames[k]
+                  << " isa=" << simd_name()
+                  << " dims=" << Arch::TransformedFeatureDimensions
+                  << " positions=" << count
+                  << " iterations=" << iterations
+                  << fixed << setprecision(1)
+                  << " ns_per_op=" << ns[k] / std::max(calls[k], uint64_t(1))
+                  << setprecision(0)
+                  << " bytes_per_op=" << bytes[k] / std::max(calls[k], uint64_t(1))
+                  << sync_endl;
+  }
+
+  // Write v in pawns in the 5 chars of buffer, e.g. "+1.23" or "-12.3"
+  void format_cp_compact(Value v, char* buffer) {
+
+    buffer[0] = (v < 0 ? '-' : v > 0 ? '+' : ' ');
+
+    int cp = std::abs(100 * v / PawnValueEg);
+
+    if (cp >= 10000)
+    {
+        buffer[1] = '0' + cp / 10000; cp %= 10000;
+        buffer[2] = '0' + cp / 1000; cp %= 1000;
+        buffer[3] = '0' + cp / 100;
+        buffer[4] = ' ';
+    }
+    else if (cp >= 1000)
+    {
+        buffer[1] = '0' + cp / 1000; cp %= 1000;
+        buffer[2] = '0' + cp / 100; cp %= 100;
+        buffer[3] = '.';
+        buffer[4] = '0' + cp / 10;
+    }
+    else
+    {
+        buffer[1] = '0' + cp / 100; cp %= 100;
+        buffer[2] = '.';
+        buffer[3] = '0' + cp / 10; cp %= 10;
+        buffer[4] = '0' + cp / 1;
+    }
+  }
+
+  // Give the layer of InDims inputs and OutDims outputs of AffineTransformVnni
+  // and of the generic AffineTransform the same random parameters, and return
+  // in how many of 'trials' random inputs, in the output range of ClippedReLU,
+  // their outputs differ.
+  template <IndexType InDims, IndexType OutDims>
+  int compare_affine_transforms(PRNG& rng, int trials) {
+
+    using Input = Layers::InputSlice<InDims>;
+    using Vnni = Layers::AffineTransformVnni<Input, OutDims>;
+    using Generic = Layers::AffineTransform<Input, OutDims>;
+
+    static_assert(Vnni::get_hash_value() == Generic::get_hash_value(), "The layers must read the same nets");
+
+    stringstream parameters;
+    for (IndexType i = 0; i < OutDims; ++i)
+        write_little_endian<int32_t>(parameters, rng.rand<int16_t>());
+    for (IndexType i = 0; i < OutDims * Vnni::PaddedInputDimensions; ++i)
+        write_little_endian<int8_t>(parameters, rng.rand<int8_t>());
+
+    auto vnni = make_unique<Vnni>();
+    auto generic = make_unique<Generic>();
+    istringstream vnniStream(parameters.str()), genericStream(parameters.str());
+    if (!vnni->read_parameters(vnniStream) || !generic->read_parameters(genericStream))
+        return trials;
+
+    alignas(CacheLineSize) TransformedFeatureType input[Vnni::PaddedInputDimensions] = {};
+    alignas(CacheLineSize) char vnniBuffer[Vnni::BufferSize];
+    alignas(CacheLineSize) char genericBuffer[Generic::BufferSize];
+
+    int mismatches = 0;
+
+    for (int t = 0; t < trials; ++t)
+    {
+        for (IndexType i = 0; i < InDims; ++i)
+            input[i] = TransformedFeatureType(rng.rand<uint8_t>() & 127);
+
+        const int32_t* vnniOutput = vnni->propagate(input, vnniBuffer);
+        const int32_t* genericOutput = generic->propagate(input, genericBuffer);
+        mismatches += std::memcmp(vnniOutput, genericOutput, OutDims * sizeof(int32_t)) != 0;
+    }
+
+    return mismatches;
+  }
+
+  // Write v in pawns in the 7 chars of buffer, with the dot always aligned
+  void format_cp_aligned_dot(Value v, char* buffer) {
+
+    buffer[0] = (v < 0 ? '-' : v > 0 ? '+' : ' ');
+    snprintf(&buffer[1], 7, "%6.2f", double(std::abs(v)) / PawnValueEg);
+  }
+
+  // The net of architecture Arch: a feature transformer and a layer stack per
+  // bucket, read from a file whose header has the hash value of Arch.
+  template <typename Arch>
+  class BasicNet final : public Net {
+
+    using Transformer = BasicFeatureTransformer<Arch>;
+    using Network = typename Arch::Network;
+
+  public:
+    static constexpr uint32_t HashValue = Transformer::get_hash_value() ^ Network::get_hash_value();
+
+    Value evaluate(const Position& pos, bool adjusted) const override {
+
+      alignas(CacheLineSize) TransformedFeatureType transformedFeatures[Transformer::BufferSize];
+      alignas(CacheLineSize) char buffer[Network::BufferSize];
+
+      const size_t bucket = (pos.count<ALL_PIECES>() - 1) / 4;
+      const int psqt = featureTransformer->transform(pos, transformedFeatures, bucket);
+      const int positional = network[bucket]->propagate(transformedFeatures, buffer)[0];
+
+      // Give more weight to the positional part when material is balanced
+      int delta_npm = abs(pos.non_pawn_material(WHITE) - pos.non_pawn_material(BLACK));
+      int entertainment = (adjusted && delta_npm <= BishopValueMg - KnightValueMg ? 7 : 0);
+
+      int A = 128 - entertainment;
+      int B = 128 + entertainment;
+
+      return static_cast<Value>((A * psqt + B * positional) / 128 / OutputScale);
+    }
+
+    void evaluate_by_bucket(const Position* const* positions, Value* values, size_t count) const override {
+
+      constexpr size_t BlockSize = 64;
+
+      alignas(CacheLineSize) TransformedFeatureType transformedFeatures[BlockSize][Transformer::BufferSize];
+      alignas(CacheLineSize) char buffer[Network::BufferSize];
+      int psqt[BlockSize];
+      size_t bucket[BlockSize];
+
+      for (size_t start = 0; start < count; start += BlockSize)
+      {
+          const size_t n = std::min(BlockSize, count - start);
+
+          for (size_t i = 0; i < n; ++i)
+          {
+              const Position& pos = *positions[start + i];
+              bucket[i] = (pos.count<ALL_PIECES>() - 1) / 4;
+              psqt[i] = featureTransformer->transform(pos, transformedFeatures[i], bucket[i]);
+          }
+
+          for (size_t b = 0; b < Arch::LayerStacks; ++b)
+              for (size_t i = 0; i < n; ++i)
+                  if (bucket[i] == b)
+                  {
+                      const auto output = network[b]->propagate(transformedFeatures[i], buffer);
+                      values[start + i] = static_cast<Value>((psqt[i] + output[0]) / OutputScale);
+                  }
+      }
+    }
+
+    void prefetch(const Position& pos) const override {
+      featureTransformer->prefetch_changed_features(pos);
+    }
+
+    void benchmark(Position* const* positions, size_t count, int iterations) const override {
+      time_kernels(*featureTransformer, network, positions, count, iterations);
+    }
+
+    // The value of each piece on a board, estimated by evaluating the position
+    // without it, and a table of the PSQT and positional parts of the output
+    // of each bucket. The accumulators are rebuilt from the biases for each
+    // evaluation, as they cannot be updated across the removal of a piece.
+    string trace(Position& pos) const override {
+
+      auto white_eval = [&]() {
+          featureTransformer->refresh_from_biases(pos);
+          Value v = evaluate(pos, false);
+          return pos.side_to_move() == WHITE ? v : -v;
+      };
+
+      char board[3 * 8 + 1][8 * 8 + 2];
+      std::memset(board, ' ', sizeof(board));
+      for (int row = 0; row < 3 * 8 + 1; ++row)
+          board[row][8 * 8 + 1] = '\0';
+
+      auto write_square = [&board](File file, Rank rank, Piece pc, Value value) {
+
+          const int x = int(file) * 8;
+          const int y = (7 - int(rank)) * 3;
+          for (int i = 1; i < 8; ++i)
+              board[y][x + i] = board[y + 3][x + i] = '-';
+          for (int i = 1; i < 3; ++i)
+              board[y + i][x] = board[y + i][x + 8] = '|';
+          board[y][x] = board[y][x + 8] = board[y + 3][x + 8] = board[y + 3][x] = '+';
+          if (pc != NO_PIECE)
+              board[y + 1][x + 4] = " PNBRQK  pnbrqk"[pc];
+          if (value != VALUE_NONE)
+              format_cp_compact(value, &board[y + 2][x + 2]);
+      };
+
+      const Value base = white_eval();
+
+      for (File f = FILE_A; f <= FILE_H; ++f)
+          for (Rank r = RANK_1; r <= RANK_8; ++r)
+          {
+              const Square sq = make_square(f, r);
+              const Piece pc = pos.piece_on(sq);
+              Value v = VALUE_NONE;
+
+              if (pc != NO_PIECE && type_of(pc) != KING)
+              {
+                  pos.remove_piece(sq);
+                  v = base - white_eval();
+                  pos.put_piece(pc, sq);
+              }
+
+              write_square(f, r, pc, v);
+          }
+
+      // Leave accumulators matching the position for the callers
+      featureTransformer->refresh_from_biases(pos);
+
+      stringstream ss;
+      ss << " NNUE derived piece values:\n";
+      for (int row = 0; row < 3 * 8 + 1; ++row)
+          ss << board[row] << '\n';
+
+      ss << "\n NNUE network contributions "
+         << (pos.side_to_move() == WHITE ? "(White to move)" : "(Black to move)") << '\n'
+         << "+------------+------------+------------+------------+\n"
+         << "|   Bucket   |  Material  | Positional |   Total    |\n"
+         << "|            |   (PSQT)   |  (Layers)  |            |\n"
+         << "+------------+------------+------------+------------+\n";
+
+      alignas(CacheLineSize) TransformedFeatureType transformedFeatures[Transformer::BufferSize];
+      alignas(CacheLineSize) char buffer[Network::BufferSize];
+
+      for (size_t bucket = 0; bucket < Arch::LayerStacks; ++bucket)
+      {
+          const Value psqt = Value(featureTransformer->transform(pos, transformedFeatures, bucket) / OutputScale);
+          const Value positional = Value(network[bucket]->propagate(transformedFeatures, buffer)[0] / OutputScale);
+
+          char cp[3][8] = {};
+          format_cp_aligned_dot(psqt, cp[0]);
+          format_cp_aligned_dot(positional, cp[1]);
+          format_cp_aligned_dot(psqt + positional, cp[2]);
+
+          ss <<  "|  " << bucket << "        "
+             << " |  " << cp[0] << "  "
+             << " |  " << cp[1] << "  "
+             << " |  " << cp[2] << "  "
+             << " |";
+          if (bucket == size_t(pos.count<ALL_PIECES>() - 1) / 4)
+              ss << " <-- this bucket is used";
+          ss << '\n';
+      }
+
+      ss << "+------------+------------+------------+------------+\n";
+
+      return ss.str();
+    }
+
+    // Read a net in the format of the evaluation files: a header with the
+    // version, the hash value and the description, then the parameters. The
+    // feature transformer weights are mapped from imageFile, if not empty.
+    bool read(istream& stream, const string& imageFile) override {
+
+      uint32_t version = read_little_endian<uint32_t>(stream);
+      uint32_t hashValue = read_little_endian<uint32_t>(stream);
+      uint32_t size = read_little_endian<uint32_t>(stream);
+      if (!stream || version != Version || hashValue != HashValue)
+          return false;
+
+      description.resize(size);
+      stream.read(&description[0], size);
+
+      if (!(featureTransformer = make_transformer()))
+          return false;
+
+      for (auto& net : network)
+      {
+          net.reset(reinterpret_cast<Network*>(std_aligned_alloc(alignof(Network), sizeof(Network))));
+          if (!net)
+              return false;
+
+          std::memset(net.get(), 0, sizeof(Network));
+      }
+
+      Transformer::ImageFile = imageFile;
+      const bool transformerRead = read_parameters(stream, *featureTransformer);
+      Transformer::ImageFile.clear();
+
+      if (!transformerRead)
+          return false;
+
+      for (auto& net : network)
+          if (!read_parameters(stream, *net))
+              return false;
+
+      return stream && stream.peek() == std::ios::traits_type::eof();
+    }
+
+    bool write(ostream& stream) const override {
+
+      write_little_endian<uint32_t>(stream, Version);
+      write_little_endian<uint32_t>(stream, HashValue);
+      write_little_endian<uint32_t>(stream, uint32_t(description.size()));
+      stream.write(&description[0], description.size());
+
+      if (!write_parameters(stream, *featureTransformer))
+          return false;
+
+      for (const auto& net : network)
+          if (!write_parameters(stream, *net))
+              return false;
+
+      return bool(stream);
+    }
+
+    unique_ptr<Net> copy() const override {
+
+      auto net = make_unique<BasicNet>();
+      net->description = description;
+
+      net->featureTransformer = make_transformer();
+      if (!net->featureTransformer || !net->featureTransformer->replicate(*featureTransformer))
+          return nullptr;
+
+      for (size_t b = 0; b < Arch::LayerStacks; ++b)
+      {
+          net->network[b].reset(reinterpret_cast<Network*>(std_aligned_alloc(alignof(Network), sizeof(Network))));
+          if (!net->network[b])
+              return nullptr;
+
+          std::memcpy(net->network[b].get(), network[b].get(), sizeof(Network));
+      }
+
+      return net;
+    }
+
+    void use_accumulators(ThreadAccumulators& accumulators) const override {
+      accumulators.use<Arch>();
+    }
+
+    IndexType dimensions() const override { return Arch::TransformedFeatureDimensions; }
+
+  private:
+    // The transformer owns its weights, freed by its destructor
+    static LargePagePtr<Transformer> make_transformer() {
+
+      void* mem = aligned_large_pages_alloc(sizeof(Transformer));
+      return LargePagePtr<Transformer>(mem ? new (mem) Transformer() : nullptr);
+    }
+
+    LargePagePtr<Transformer> featureTransformer;
+    AlignedPtr<Network> network[Arch::LayerStacks];
+    string description;
+  };
+
+  static_assert(BasicNet<SpeedArchitecture>::HashValue != BasicNet<DefaultArchitecture>::HashValue,
+                "The architecture of a net must be recognizable from its hash");
+
+  // Create an empty net of the architecture with the given hash value, if any
+  template <typename... Archs>
+  struct NetFactory {
+
+    static unique_ptr<Net> create(uint32_t hashValue) {
+
+      unique_ptr<Net> net;
+      ((hashValue == BasicNet<Archs>::HashValue ? void(net = make_unique<BasicNet<Archs>>()) : void()), ...);
+      return net;
+    }
+  };
+
+  // The net loaded last, and its copies on the NUMA nodes the threads are
+  // bound to, see replicate().
+  unique_ptr<Net> loadedNet;
+  vector<unique_ptr<Net>> replicas;
+  size_t replicatedNodes;
+
+  // The net evaluating for the thread of the position, set by replicate()
+  const Net& net_of(const Position& pos) {
+
+    assert(pos.this_thread()->net);
+    return *pos.this_thread()->net;
+  }
+
+  // Load the net of the stream, of the architecture given by the hash value of
+  // its header. The stream must be able to seek back to the start of the net.
+  bool load_net(istream& stream, const string& imageFile) {
+
+    read_little_endian<uint32_t>(stream); // Version, checked when reading the net
+    const uint32_t hashValue = read_little_endian<uint32_t>(stream);
+    if (!stream || !stream.seekg(0))
+        return false;
+
+    unique_ptr<Net> net = ForEachArchitecture<NetFactory>::create(hashValue);
+    if (!net || !net->read(stream, imageFile))
+        return false;
+
+    loadedNet = std::move(net);
+    return true;
+  }
+
+  } // namespace
+
+  // Whether do_move() prefetches the rows of the changed features, set by the
+  // "Prefetch Weights" option. Off by default: the gain is not measurable on
+  // every machine, see prefetchbench, and the cost is paid on every move.
+  bool prefetchWeights = false;
+
+  /// prefetch_weights() is called by Position::do_move(), when prefetchWeights
+  /// is set, to preload the weights of the features changed by the move, in the
+  /// feature transformer of the net of the thread. The positions that evaluate()
+  /// hands over to the classical evaluation are skipped, their accumulators are
+  /// not updated.
+
+  void prefetch_weights(const Position& pos) {
+
+    if (use_classical(pos))
+        return;
+
+    if (const Net* net = pos.this_thread()->net)
+        net->prefetch(pos);
+  }
+
+  /// NNUE::benchmark() times the kernels of the net of the thread of the given
+  /// positions, set up on the main thread, for the "nnuebench" command.
+
+  void benchmark(Position* const* positions, size_t count, int iterations) {
+
+    if (count)
+        net_of(*positions[0]).benchmark(positions, count, iterations);
+  }
+
+  /// NNUE::test_kernels() checks, for the "vnnitest" command, that the shapes
+  /// of AffineTransformVnni used by the nets give bit-exact results against the
+  /// generic AffineTransform on random inputs. Returns true if all of them do.
+
+  bool test_kernels(int trials) {
+
+    PRNG rng(1070372);
+    const int mismatches[] = { compare_affine_transforms<16, 32>(rng, trials),
+                               compare_affine_transforms<32,  1>(rng, trials) };
+    const char* shapes[] = { "16x32", "32x1" };
+
+    for (int i = 0; i < 2; ++i)
+        sync_cout << "AffineTransformVnni " << shapes[i] << " (" << simd_name() << "): "
+                  << mismatches[i] << " of " << trials << " random inputs differ"
+                  << sync_endl;
+
+    return !mismatches[0] && !mismatches[1];
+  }
+
+  /// NNUE::replicate() gives each thread the net to evaluate with. With the
+  /// "NUMA Replication" option, when the threads are bound to NUMA nodes, the
+  /// net loaded is copied once per node by the first thread of the node, so
+  /// that the threads of the node read their weights from local memory.
+  /// Otherwise all the threads use the net loaded. It is called when the net
+  /// or the threads change, and never during a search.
+
+  void replicate() {
+
+    replicas.clear();
+
+    // Node of each thread, see Thread::idle_loop(), as 1 + index in replicas
+    vector<size_t> replicaOf(Threads.size(), 0);
+    vector<size_t> firstThreadOf;
+
+    if (loadedNet && useNNUE && Options["NUMA Replication"] && Options["Threads"] > 8)
+    {
+        map<int, size_t> replicaOfNode;
+
+        for (size_t idx = 0; idx < Threads.size(); ++idx)
+        {
+            const int node = WinProcGroup::best_node(idx);
+            if (!replicaOfNode.count(node))
+            {
+                replicaOfNode[node] = firstThreadOf.size() + 1;
+                firstThreadOf.push_back(idx);
+            }
+            replicaOf[idx] = replicaOfNode[node];
+        }
+
+        // The net stays shared when there is a single node
+        if (firstThreadOf.size() < 2)
+            fill(replicaOf.begin(), replicaOf.end(), 0), firstThreadOf.clear();
+    }
+
+    replicas.resize(firstThreadOf.size());
+
+    for (size_t i = 0; i < firstThreadOf.size(); ++i)
+        Threads[firstThreadOf[i]]->run_custom_job([i]() { replicas[i] = loadedNet->copy(); });
+
+    for (size_t idx : firstThreadOf)
+        Threads[idx]->wait_for_search_finished();
+
+    // A node whose copy failed uses the net loaded
+    for (size_t idx = 0; idx < Threads.size(); ++idx)
+        if (replicaOf[idx] && !replicas[replicaOf[idx] - 1])
+            replicaOf[idx] = 0;
+
+    replicatedNodes = size_t(count_if(replicas.begin(), replicas.end(),
+                                      [](const unique_ptr<Net>& net) { return bool(net); }));
+
+    for (size_t idx = 0; idx < Threads.size(); ++idx)
+    {
+        Threads[idx]->net = replicaOf[idx] ? replicas[replicaOf[idx] - 1].get() : loadedNet.get();
+
+        if (loadedNet)
+            loadedNet->use_accumulators(Threads[idx]->accumulators);
+    }
+
+    if (loadedNet)
+        loadedNet->use_accumulators(Threads.uciAccumulators);
+  }
+
+  /// NNUE::report_replication() tells the GUI, at "isready", whether the nets
+  /// are replicated on the NUMA nodes.
+
+  void report_replication() {
+
+    if (!Options["NUMA Replication"])
+        return;
+
+    if (replicatedNodes)
+        sync_cout << "info string NNUE network replicated on "
+                  << replicatedNodes << " NUMA nodes" << sync_endl;
+    else
+        sync_cout << "info string NNUE network not replicated, the threads"
+                     " are not bound to several NUMA nodes" << sync_endl;
+  }
+
+} // namespace Eval::NNUE
+
 namespace Eval {
 
   bool useNNUE;
@@ -59,9 +751,16 @@ namespace Eval {
   /// network may be embedded in the binary), in the active working directory and
   /// in the engine directory. Distro packagers may define the DEFAULT_NNUE_DIRECTORY
   /// variable to have the engine search in a special directory in their distro.
+  /// With the "Mmap EvalFile" option, the feature transformer weights of a net
+  /// loaded from a file are mapped from an image next to it ("<net>.img", written
+  /// on first load), so that all the engine processes of the host share them.
 
   void NNUE::init() {
 
+    // Cached evaluations were computed with the previous net, if any
+    for (Thread* th : Threads)
+        th->evalCache.clear();
+
     useNNUE = Options["Use NNUE"];
     if (!useNNUE)
         return;
@@ -82,7 +781,7 @@ namespace Eval {
             if (directory != "<internal>")
             {
                 ifstream stream(directory + eval_file, ios::binary);
-                if (load_eval(eval_file, stream))
+                if (load_net(stream, Options["Mmap EvalFile"] ? directory + eval_file + ".img" : ""))
                     eval_file_loaded = eval_file;
             }
 
@@ -91,16 +790,24 @@ namespace Eval {
                 // C++ way to prepare a buffer for a memory stream
                 class MemoryBuffer : public basic_streambuf<char> {
                     public: MemoryBuffer(char* p, size_t n) { setg(p, p, p + n); setp(p, p + n); }
+                    pos_type seekpos(pos_type pos, ios_base::openmode) override { setg(eback(), eback() + pos, egptr()); return pos; }
                 };
 
                 MemoryBuffer buffer(const_cast<char*>(reinterpret_cast<const char*>(gEmbeddedNNUEData)),
                                     size_t(gEmbeddedNNUESize));
 
                 istream stream(&buffer);
-                if (load_eval(eval_file, stream))
+                if (load_net(stream, ""))
                     eval_file_loaded = eval_file;
             }
         }
+
+    // Cached accumulators were computed with the weights of the previous net
+    for (Thread* th : Threads)
+        th->accumulators.clear();
+    Threads.uciAccumulators.clear();
+
+    replicate();
   }
 
   /// NNUE::verify() verifies that the last net used was loaded successfully
@@ -129,10 +836,78 @@ namespace Eval {
     }
 
     if (useNNUE)
-        sync_cout << "info string NNUE evaluation using " << eval_file << " enabled" << sync_endl;
+        sync_cout << "info string NNUE evaluation using " << eval_file
+                  << (loadedNet->dimensions() != TransformedFeatureDimensions ?
+                      " (" + to_string(loadedNet->dimensions()) + "x2 architecture)" : "")
+                  << " enabled" << sync_endl;
     else
         sync_cout << "info string classical evaluation enabled" << sync_endl;
   }
+
+  /// EvalCache::resize() sets the size of the cache to the largest power of 2
+  /// number of entries that fits in mbSize megabytes, clears it and resets the
+  /// statistics. A size of 0 disables the cache.
+
+  void EvalCache::resize(size_t mbSize) {
+
+    size_t count = mbSize * 1024 * 1024 / sizeof(Entry);
+    while (count & (count - 1))
+        count &= count - 1;
+
+    if (count != table.size())
+    {
+        table.clear();
+        table.shrink_to_fit();
+        table.resize(count);
+        mask = count - 1;
+    }
+
+    clear();
+    hits = probes = 0;
+  }
+
+  /// EvalCache::clear() drops all the cached evaluations
+
+  void EvalCache::clear() {
+
+    std::fill(table.begin(), table.end(), Entry());
+  }
+
+  /// NNUE::evaluate_by_bucket() stores in values[i] the unadjusted evaluation of
+  /// the net for positions[i]. It is a loop over the positions, not a batched
+  /// kernel: the positions are transformed a block at a time, then those of a
+  /// block are propagated one by one, sorted by layer stack bucket, so that the
+  /// weights of a network stay in cache while it is used.
+
+  void NNUE::evaluate_by_bucket(const Position* const* positions, Value* values, size_t count) {
+
+    if (count)
+        net_of(*positions[0]).evaluate_by_bucket(positions, values, count);
+  }
+
+  /// NNUE::save_eval() saves the net that was loaded last, under the given
+  /// name, or under its own name if it is the embedded net.
+
+  bool NNUE::save_eval(const std::optional<string>& filename) {
+
+    string actualFilename;
+
+    if (filename.has_value())
+        actualFilename = filename.value();
+    else if (eval_file_loaded != EvalFileDefaultName)
+    {
+        sync_cout << "Failed to export a net. A non-embedded net can only be saved if the filename is specified" << sync_endl;
+        return false;
+    }
+    else
+        actualFilename = EvalFileDefaultName;
+
+    ofstream stream(actualFilename, ios::binary);
+    bool saved = loadedNet && loadedNet->write(stream);
+
+    sync_cout << (saved ? "Network saved successfully to " + actualFilename : "Failed to export a net") << sync_endl;
+    return saved;
+  }
 }
 
 namespace Trace {
@@ -388,10 +1163,16 @@ namespace {
     {
         Square s = pop_lsb(b1);
 
-        // Find attacked squares, including x-ray attacks for bishops and rooks
-        b = Pt == BISHOP ? attacks_bb<BISHOP>(s, pos.pieces() ^ pos.pieces(QUEEN))
-          : Pt ==   ROOK ? attacks_bb<  ROOK>(s, pos.pieces() ^ pos.pieces(QUEEN) ^ pos.pieces(Us, ROOK))
-                         : attacks_bb<Pt>(s, pos.pieces());
+        // Find attacked squares, including x-ray attacks for bishops and rooks.
+        // These differ from the attacks kept by the position only when one of
+        // the pieces seen through is attacked.
+        b = pos.attacks_from<Pt>(s);
+
+        if (Pt == BISHOP && (b & pos.pieces(QUEEN)))
+            b = attacks_bb<BISHOP>(s, pos.pieces() ^ pos.pieces(QUEEN));
+
+        else if (Pt == ROOK && (b & (pos.pieces(QUEEN) | pos.pieces(Us, ROOK))))
+            b = attacks_bb<  ROOK>(s, pos.pieces() ^ pos.pieces(QUEEN) ^ pos.pieces(Us, ROOK));
 
         if (pos.blockers_for_king(Us) & s)
             b &= line_bb(pos.square<KING>(Us), s);
@@ -1065,6 +1846,19 @@ make_v:
 } // namespace Eval
 
 
+/// use_classical() tells whether evaluate() with NNUE enabled uses the classical
+/// evaluation for the position. If there is PSQ imbalance we use the classical
+/// eval, but we switch to NNUE eval faster when shuffling or if the material on
+/// the board is high.
+
+bool Eval::use_classical(const Position& pos) {
+
+  int r50 = pos.rule50_count();
+  Value psq = Value(abs(eg_value(pos.psq_score())));
+  return psq * 5 > (850 + pos.non_pawn_material() / 64) * (5 + r50);
+}
+
+
 /// evaluate() is the evaluator for the outer world. It returns a static
 /// evaluation of the position from the point of view of the side to move.
 
@@ -1083,7 +1877,7 @@ Value Eval::evaluate(const Position& pos) {
                      + 32 * pos.count<PAWN>()
                      + 32 * pos.non_pawn_material() / 1024;
 
-         Value nnue = NNUE::evaluate(pos, true) * scale / 1024;
+         Value nnue = NNUE::net_of(pos).evaluate(pos, true) * scale / 1024;
 
          if (pos.is_chess960())
              nnue += fix_FRC(pos);
@@ -1091,14 +1885,19 @@ Value Eval::evaluate(const Position& pos) {
          return nnue;
       };
 
-      // If there is PSQ imbalance we use the classical eval, but we switch to
-      // NNUE eval faster when shuffling or if the material on the board is high.
-      int r50 = pos.rule50_count();
-      Value psq = Value(abs(eg_value(pos.psq_score())));
-      bool classical = psq * 5 > (850 + pos.non_pawn_material() / 64) * (5 + r50);
-
-      v = classical ? Evaluation<NO_TRACE>(pos).value()  // classical
-                    : adjusted_NNUE();                   // NNUE
+      if (use_classical(pos))
+          v = Evaluation<NO_TRACE>(pos).value();
+      else
+      {
+          // Only the NNUE evaluations are cached, the classical one depends
+          // on the dynamic contempt of the thread.
+          EvalCache& cache = pos.this_thread()->evalCache;
+          if (!cache.probe(pos.key(), v))
+          {
+              v = adjusted_NNUE();
+              cache.save(pos.key(), v);
+          }
+      }
   }
 
   // Damp down the evaluation linearly when shuffling
@@ -1155,7 +1954,7 @@ std::string Eval::trace(Position& pos) {
      << "+------------+-------------+-------------+-------------+\n";
 
   if (Eval::useNNUE)
-      ss << '\n' << NNUE::trace(pos) << '\n';
+      ss << '\n' << NNUE::net_of(pos).trace(pos) << '\n';
 
   ss << std::showpoint << std::showpos << std::fixed << std::setprecision(2) << std::setw(15);
 
@@ -1163,7 +1962,7 @@ std::string Eval::trace(Position& pos) {
   ss << "\nClassical evaluation   " << to_cp(v) << " (white side)\n";
   if (Eval::useNNUE)
   {
-      v = NNUE::evaluate(pos, false);
+      v = NNUE::net_of(pos).evaluate(pos, false);
       v = pos.side_to_move() == WHITE ? v : -v;
       ss << "NNUE evaluation        " << to_cp(v) << " (white side)\n";
   }
@@ -10,6 +10,7 @@
 
 #include <string>
 #include <optional>
+#include <vector>
 
 #include "types.h"
 
@@ -21,10 +22,53 @@ namespace Eval {
 
   std::string trace(Position& pos);
   Value evaluate(const Position& pos);
+  bool use_classical(const Position& pos);
 
   extern bool useNNUE;
   extern std::string eval_file_loaded;
 
+  // EvalCache is a direct-mapped, per-thread cache of the scaled NNUE evaluations,
+  // indexed by the low bits of the position key and verified with its high bits.
+  // It saves a feature transformer update and a network propagation on a hit.
+  // The search rarely evaluates a position twice, so it is off by default: the
+  // "Eval Cache" option gives its size in MB.
+  class EvalCache {
+
+    struct Entry {
+      uint32_t key32;
+      int32_t  value;
+    };
+
+  public:
+    void resize(size_t mbSize);
+    void clear();
+
+    bool probe(Key key, Value& v) {
+      if (table.empty())
+          return false;
+
+      ++probes;
+      const Entry& e = table[key & mask];
+      if (e.key32 != uint32_t(key >> 32))
+          return false;
+
+      ++hits;
+      v = Value(e.value);
+      return true;
+    }
+
+    void save(Key key, Value v) {
+      if (!table.empty())
+          table[key & mask] = { uint32_t(key >> 32), int32_t(v) };
+    }
+
+    uint64_t hits, probes;
+
+  private:
+    std::vector<Entry> table;
+    size_t mask;
+  };
+
   // The default net name MUST follow the format nn-[SHA256 first 12 digits].nnue
   // for the build process (profile-build and fishtest) to work. Do not change the
   // name of the macro, as it is used in the Makefile.
@@ -32,14 +76,20 @@ namespace Eval {
 
   namespace NNUE {
 
-    std::string trace(Position& pos);
-    Value evaluate(const Position& pos, bool adjusted = false);
+    void evaluate_by_bucket(const Position* const* positions, Value* values, std::size_t count);
+    void benchmark(Position* const* positions, std::size_t count, int iterations);
+    bool test_kernels(int trials);
+
+    extern bool prefetchWeights;
+    void prefetch_weights(const Position& pos);
+
+    struct Net;
+    void replicate();
+    void report_replication();
 
     void init();
     void verify();
 
-    bool load_eval(std::string name, std::istream& stream);
-    bool save_eval(std::ostream& stream);
     bool save_eval(const std::optional<std::string>& filename);
 
   } // namespace NNUE
@@ -0,0 +1,105 @@
+/*
+  Nayeem  - A UCI chess engine Based on Stockfish. Copyright (C) 2013-2021 Mohamed Nayeem
+  Family  - Stockfish
+  Author  - Mohamed Nayeem
+  License - GPL-3.0
+*/
+
+// Entry point of the fat binary built by 'make fat-build'. The whole engine is
+// compiled once per architecture of FAT_ARCHS, each copy having its own entry
+// point fat_main_<arch> and its own static constructors, see the fat-object
+// target of the Makefile. At startup we query the CPU with CPUID, then run the
+// static constructors and the entry point of the best engine it supports.
+
+#include <cstdlib>
+#include <iostream>
+
+#include "evaluate.h"
+#include "incbin/incbin.h"
+
+// The default net is embedded once, and shared by all the engines
+#if !defined(_MSC_VER) && !defined(NNUE_EMBEDDING_OFF)
+  INCBIN(EmbeddedNNUE, EvalFileDefaultName);
+#endif
+
+// The engines are weak references, so that FAT_ARCHS may be any subset of them
+#define FAT_ENGINE(name) \
+  extern "C" int fat_main_##name(int, char**) __attribute__((weak)); \
+  extern "C" void (*const __start_fat_init_##name[])() __attribute__((weak)); \
+  extern "C" void (*const __stop_fat_init_##name[])() __attribute__((weak));
+
+FAT_ENGINE(x86_64_vnni512)
+FAT_ENGINE(x86_64_vnni256)
+FAT_ENGINE(x86_64_avx512)
+FAT_ENGINE(x86_64_bmi2)
+FAT_ENGINE(x86_64_avx2)
+FAT_ENGINE(x86_64_sse41_popcnt)
+FAT_ENGINE(x86_64_ssse3)
+FAT_ENGINE(x86_64_sse3_popcnt)
+FAT_ENGINE(x86_64)
+
+#undef FAT_ENGINE
+
+namespace {
+
+  #define has(feature) __builtin_cpu_supports(feature)
+
+  // pext is microcoded, thus very slow, before Zen 3
+  bool fast_pext() {
+    return has("bmi2") && !__builtin_cpu_is("znver1") && !__builtin_cpu_is("znver2");
+  }
+
+  bool vnni512()      { return has("avx512vnni") && has("avx512vl") && has("avx512dq") && has("avx512bw") && fast_pext(); }
+  bool vnni256()      { return has("avx512vnni") && has("avx512vl") && has("avx512dq") && has("avx2") && fast_pext(); }
+  bool avx512()       { return has("avx512f") && has("avx512bw") && fast_pext(); }
+  bool bmi2()         { return has("avx2") && fast_pext(); }
+  bool avx2()         { return has("avx2") && has("popcnt"); }
+  bool sse41_popcnt() { return has("sse4.1") && has("popcnt"); }
+  bool ssse3()        { return has("ssse3"); }
+  bool sse3_popcnt()  { return has("sse3") && has("popcnt"); }
+  bool x86_64()       { return true; }
+
+  struct Engine {
+    bool (*supported)();
+    int (*main)(int, char**);
+    void (*const* initBegin)();
+    void (*const* initEnd)();
+  };
+
+  #define FAT_ENGINE(name) \
+    { name, fat_main_x86_64_##name, __start_fat_init_x86_64_##name, __stop_fat_init_x86_64_##name }
+
+  // By order of preference
+  const Engine Engines[] = {
+    FAT_ENGINE(vnni512),
+    FAT_ENGINE(avx512),
+    FAT_ENGINE(vnni256),
+    FAT_ENGINE(bmi2),
+    FAT_ENGINE(avx2),
+    FAT_ENGINE(sse41_popcnt),
+    FAT_ENGINE(ssse3),
+    FAT_ENGINE(sse3_popcnt),
+    { x86_64, fat_main_x86_64, __start_fat_init_x86_64, __stop_fat_init_x86_64 }
+  };
+
+  #undef FAT_ENGINE
+  #undef has
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+
+  __builtin_cpu_init();
+
+  for (const Engine& e : Engines)
+      if (e.main && e.supported())
+      {
+          for (auto init = e.initBegin; init != e.initEnd; ++init)
+              (*init)();
+
+          return e.main(argc, argv);
+      }
+
+  std::cerr << "No engine of this binary is supported by the CPU" << std::endl;
+  return EXIT_FAILURE;
+}
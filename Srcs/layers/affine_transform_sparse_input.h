@@ -0,0 +1,218 @@
+/*
+  Nayeem  - A UCI chess engine Based on Stockfish. Copyright (C) 2013-2021 Mohamed Nayeem
+  Family  - Stockfish
+  Author  - Mohamed Nayeem
+  License - GPL-3.0
+*/
+
+// Definition of layer AffineTransformSparseInput of NNUE evaluation function
+
+#ifndef NNUE_LAYERS_AFFINE_TRANSFORM_SPARSE_INPUT_H_INCLUDED
+#define NNUE_LAYERS_AFFINE_TRANSFORM_SPARSE_INPUT_H_INCLUDED
+
+#include <cstring>
+#include <iostream>
+#include <type_traits>
+
+#include "../nnue_common.h"
+#include "../../bitboard.h"  // for lsb()
+
+#if !defined(USE_SSSE3)
+#error "AffineTransformSparseInput needs SSSE3, use AffineTransform instead"
+#endif
+
+namespace Stockfish::Eval::NNUE::Layers {
+
+  // Affine transformation layer for inputs that are mostly zero, as is the
+  // case of the clipped output of the feature transformer. The input is split
+  // in chunks of 4 bytes; the non-zero chunks are found with a SIMD compare
+  // and a movemask, and only the weight columns of those chunks are used.
+  // The layer reads and writes the same parameters as AffineTransform, which
+  // is used instead on targets without SSSE3.
+  template <typename PreviousLayer, IndexType OutDims>
+  class AffineTransformSparseInput {
+   public:
+    // Input/output type
+    using InputType = typename PreviousLayer::OutputType;
+    using OutputType = std::int32_t;
+    static_assert(std::is_same<InputType, std::uint8_t>::value, "");
+
+    // Number of input/output dimensions
+    static constexpr IndexType InputDimensions = PreviousLayer::OutputDimensions;
+    static constexpr IndexType OutputDimensions = OutDims;
+    static constexpr IndexType PaddedInputDimensions =
+        ceil_to_multiple<IndexType>(InputDimensions, MaxSimdWidth);
+
+    // Size of forward propagation buffer used in this layer
+    static constexpr std::size_t SelfBufferSize =
+        ceil_to_multiple(OutputDimensions * sizeof(OutputType), CacheLineSize);
+
+    // Size of the forward propagation buffer used from the input layer to this layer
+    static constexpr std::size_t BufferSize =
+        PreviousLayer::BufferSize + SelfBufferSize;
+
+    // Hash value embedded in the evaluation file, the same as AffineTransform
+    static constexpr std::uint32_t get_hash_value() {
+      std::uint32_t hashValue = 0xCC03DAE4u;
+      hashValue += OutputDimensions;
+      hashValue ^= PreviousLayer::get_hash_value() >> 1;
+      hashValue ^= PreviousLayer::get_hash_value() << 31;
+      return hashValue;
+    }
+
+    // Read network parameters
+    bool read_parameters(std::istream& stream) {
+      if (!previousLayer.read_parameters(stream)) return false;
+      for (std::size_t i = 0; i < OutputDimensions; ++i)
+        biases[i] = read_little_endian<BiasType>(stream);
+      for (std::size_t i = 0; i < OutputDimensions * PaddedInputDimensions; ++i)
+        weights[get_weight_index(i)] = read_little_endian<WeightType>(stream);
+      return !stream.fail();
+    }
+
+    // Write network parameters
+    bool write_parameters(std::ostream& stream) const {
+      if (!previousLayer.write_parameters(stream)) return false;
+      for (std::size_t i = 0; i < OutputDimensions; ++i)
+          write_little_endian<BiasType>(stream, biases[i]);
+      for (std::size_t i = 0; i < OutputDimensions * PaddedInputDimensions; ++i)
+          write_little_endian<WeightType>(stream, weights[get_weight_index(i)]);
+      return !stream.fail();
+    }
+
+    // Forward propagation
+    const OutputType* propagate(
+        const TransformedFeatureType* transformedFeatures, char* buffer) const {
+      const auto input = previousLayer.propagate(
+          transformedFeatures, buffer + SelfBufferSize);
+      auto output = reinterpret_cast<OutputType*>(buffer);
+
+      // The chunks are copied, not read through an int32 pointer, which would
+      // break strict aliasing on the output of the feature transformer.
+      const auto chunk = [input](IndexType i) {
+          std::int32_t c;
+          std::memcpy(&c, &input[i * ChunkSize], ChunkSize);
+          return c;
+      };
+
+      // Indices of the non-zero input chunks
+      std::uint16_t nnz[NumChunks];
+      IndexType count = 0;
+
+  #if defined(USE_AVX512)
+      using vec_t = __m512i;
+      #define vec_set_32 _mm512_set1_epi32
+      #define vec_nnz(a) _mm512_cmpgt_epi32_mask(a, _mm512_setzero_si512())
+      auto& vec_add_dpbusd_32 = m512_add_dpbusd_epi32;
+  #elif defined(USE_AVX2)
+      using vec_t = __m256i;
+      #define vec_set_32 _mm256_set1_epi32
+      #define vec_nnz(a) _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(a, _mm256_setzero_si256())))
+      auto& vec_add_dpbusd_32 = m256_add_dpbusd_epi32;
+  #elif defined(USE_SSSE3)
+      using vec_t = __m128i;
+      #define vec_set_32 _mm_set1_epi32
+      #define vec_nnz(a) _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(a, _mm_setzero_si128())))
+      auto& vec_add_dpbusd_32 = m128_add_dpbusd_epi32;
+  #endif
+
+      constexpr IndexType ChunksPerVector = sizeof(vec_t) / ChunkSize;
+      constexpr IndexType OutputsPerVector = sizeof(vec_t) / sizeof(OutputType);
+      constexpr IndexType NumRegs = OutputDimensions / OutputsPerVector;
+      static_assert(NumChunks % ChunksPerVector == 0, "");
+      static_assert(OutputDimensions % OutputsPerVector == 0, "");
+
+      // Input bytes are in [0, 127], so a chunk is non-zero if and only
+      // if it is positive when read as a 32-bit integer.
+      const auto inputVector = reinterpret_cast<const vec_t*>(input);
+      for (IndexType i = 0; i < NumChunks / ChunksPerVector; ++i)
+      {
+          unsigned mask = vec_nnz(inputVector[i]);
+          while (mask)
+          {
+              nnz[count++] = std::uint16_t(i * ChunksPerVector + IndexType(lsb(mask)));
+              mask &= mask - 1;
+          }
+      }
+
+      const auto biasVector = reinterpret_cast<const vec_t*>(biases);
+      vec_t acc[NumRegs];
+      for (IndexType k = 0; k < NumRegs; ++k)
+          acc[k] = biasVector[k];
+
+      for (IndexType j = 0; j < count; ++j)
+      {
+          const vec_t in = vec_set_32(chunk(nnz[j]));
+          const auto column = reinterpret_cast<const vec_t*>(&weights[nnz[j] * OutputDimensions * ChunkSize]);
+          for (IndexType k = 0; k < NumRegs; ++k)
+              vec_add_dpbusd_32(acc[k], in, column[k]);
+      }
+
+      auto outputVector = reinterpret_cast<vec_t*>(output);
+      for (IndexType k = 0; k < NumRegs; ++k)
+          outputVector[k] = acc[k];
+
+  #undef vec_set_32
+  #undef vec_nnz
+
+      return output;
+    }
+
+   private:
+    using BiasType = OutputType;
+    using WeightType = std::int8_t;
+
+    // Inputs are processed in chunks of 4 bytes, one 32-bit lane each
+    static constexpr IndexType ChunkSize = 4;
+    static constexpr IndexType NumChunks = PaddedInputDimensions / ChunkSize;
+
+    // The weights are stored column by column: the 4 weights of a chunk for
+    // each output are contiguous, followed by those of the next output, so
+    // that the weights used by a non-zero chunk are a single contiguous block.
+    static constexpr IndexType get_weight_index(IndexType i) {
+      return (i % PaddedInputDimensions) / ChunkSize * OutputDimensions * ChunkSize
+           + i / PaddedInputDimensions * ChunkSize
+           + i % ChunkSize;
+    }
+
+  #if defined(USE_AVX512)
+    static void m512_add_dpbusd_epi32(__m512i& acc, __m512i a, __m512i b) {
+    #if defined(USE_VNNI)
+      acc = _mm512_dpbusd_epi32(acc, a, b);
+    #else
+      __m512i product0 = _mm512_maddubs_epi16(a, b);
+      product0 = _mm512_madd_epi16(product0, _mm512_set1_epi16(1));
+      acc = _mm512_add_epi32(acc, product0);
+    #endif
+    }
+  #endif
+
+  #if defined(USE_AVX2)
+    static void m256_add_dpbusd_epi32(__m256i& acc, __m256i a, __m256i b) {
+    #if defined(USE_VNNI)
+      acc = _mm256_dpbusd_epi32(acc, a, b);
+    #else
+      __m256i product0 = _mm256_maddubs_epi16(a, b);
+      product0 = _mm256_madd_epi16(product0, _mm256_set1_epi16(1));
+      acc = _mm256_add_epi32(acc, product0);
+    #endif
+    }
+  #endif
+
+  #if defined(USE_SSSE3)
+    static void m128_add_dpbusd_epi32(__m128i& acc, __m128i a, __m128i b) {
+      __m128i product0 = _mm_maddubs_epi16(a, b);
+      product0 = _mm_madd_epi16(product0, _mm_set1_epi16(1));
+      acc = _mm_add_epi32(acc, product0);
+    }
+  #endif
+
+    PreviousLayer previousLayer;
+
+    alignas(CacheLineSize) BiasType biases[OutputDimensions];
+    alignas(CacheLineSize) WeightType weights[OutputDimensions * PaddedInputDimensions];
+  };
+
+}  // namespace Stockfish::Eval::NNUE::Layers
+
+#endif // #ifndef NNUE_LAYERS_AFFINE_TRANSFORM_SPARSE_INPUT_H_INCLUDED
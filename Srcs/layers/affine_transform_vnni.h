@@ -0,0 +1,217 @@
+/*
+  Nayeem  - A UCI chess engine Based on Stockfish. Copyright (C) 2013-2021 Mohamed Nayeem
+  Family  - Stockfish
+  Author  - Mohamed Nayeem
+  License - GPL-3.0
+*/
+
+// Definition of layer AffineTransformVnni of NNUE evaluation function
+
+#ifndef NNUE_LAYERS_AFFINE_TRANSFORM_VNNI_H_INCLUDED
+#define NNUE_LAYERS_AFFINE_TRANSFORM_VNNI_H_INCLUDED
+
+#include <cstring>
+#include <iostream>
+#include <type_traits>
+
+#include "../nnue_common.h"
+
+namespace Stockfish::Eval::NNUE::Layers {
+
+  // Kernel of AffineTransformVnni for a given layer shape: the order in which
+  // the weights are stored, and the forward propagation. The generic kernel
+  // is a plain loop over the weights in file order.
+  template <IndexType InDims, IndexType OutDims>
+  struct VnniKernel {
+
+    static constexpr IndexType PaddedInputDimensions =
+        ceil_to_multiple<IndexType>(InDims, MaxSimdWidth);
+
+    static constexpr IndexType get_weight_index(IndexType i) { return i; }
+
+    static void propagate(const std::int8_t* weights, const std::int32_t* biases,
+                          const std::uint8_t* input, std::int32_t* output) {
+
+      for (IndexType i = 0; i < OutDims; ++i)
+      {
+          const IndexType offset = i * PaddedInputDimensions;
+          std::int32_t sum = biases[i];
+          for (IndexType j = 0; j < InDims; ++j)
+              sum += weights[offset + j] * input[j];
+          output[i] = sum;
+      }
+    }
+  };
+
+#if defined(USE_VNNI)
+
+  // Second hidden layer, 16 inputs and 32 outputs. The inputs are taken 4
+  // bytes at a time: each group is broadcast and multiplied by the weights
+  // of the 32 outputs with one vpdpbusd per register of outputs, so the
+  // weights of a group are stored contiguously.
+  template <>
+  struct VnniKernel<16, 32> {
+
+    static constexpr IndexType InputDimensions = 16;
+    static constexpr IndexType OutputDimensions = 32;
+    static constexpr IndexType PaddedInputDimensions =
+        ceil_to_multiple<IndexType>(InputDimensions, MaxSimdWidth);
+    static constexpr IndexType ChunkSize = 4;
+    static constexpr IndexType NumChunks = InputDimensions / ChunkSize;
+
+    static constexpr IndexType get_weight_index(IndexType i) {
+      return (i % PaddedInputDimensions) / ChunkSize * OutputDimensions * ChunkSize
+           + i / PaddedInputDimensions * ChunkSize
+           + i % ChunkSize;
+    }
+
+    static void propagate(const std::int8_t* weights, const std::int32_t* biases,
+                          const std::uint8_t* input, std::int32_t* output) {
+
+  #if defined(USE_AVX512)
+      using vec_t = __m512i;
+      #define vec_load(a) _mm512_load_si512(a)
+      #define vec_store(a, b) _mm512_store_si512(a, b)
+      #define vec_set_32 _mm512_set1_epi32
+      #define vec_dpbusd_32 _mm512_dpbusd_epi32
+  #else
+      using vec_t = __m256i;
+      #define vec_load(a) _mm256_load_si256(a)
+      #define vec_store(a, b) _mm256_store_si256(a, b)
+      #define vec_set_32 _mm256_set1_epi32
+      #define vec_dpbusd_32 _mm256_dpbusd_epi32
+  #endif
+
+      constexpr IndexType NumRegs = OutputDimensions * sizeof(std::int32_t) / sizeof(vec_t);
+
+      const auto biasVector = reinterpret_cast<const vec_t*>(biases);
+      vec_t acc[NumRegs];
+      for (IndexType k = 0; k < NumRegs; ++k)
+          acc[k] = vec_load(&biasVector[k]);
+
+      for (IndexType i = 0; i < NumChunks; ++i)
+      {
+          // The input bytes are copied, not read through an int32 pointer,
+          // which would break strict aliasing on the buffer of ClippedReLU.
+          std::int32_t in32;
+          std::memcpy(&in32, &input[i * ChunkSize], ChunkSize);
+          const vec_t in = vec_set_32(in32);
+          const auto column = reinterpret_cast<const vec_t*>(&weights[i * OutputDimensions * ChunkSize]);
+          for (IndexType k = 0; k < NumRegs; ++k)
+              acc[k] = vec_dpbusd_32(acc[k], in, vec_load(&column[k]));
+      }
+
+      auto outputVector = reinterpret_cast<vec_t*>(output);
+      for (IndexType k = 0; k < NumRegs; ++k)
+          vec_store(&outputVector[k], acc[k]);
+
+  #undef vec_load
+  #undef vec_store
+  #undef vec_set_32
+  #undef vec_dpbusd_32
+    }
+  };
+
+  // Output layer, 32 inputs and a single output: one vpdpbusd of the whole
+  // input with the weight row, followed by a horizontal sum.
+  template <>
+  struct VnniKernel<32, 1> {
+
+    static constexpr IndexType get_weight_index(IndexType i) { return i; }
+
+    static void propagate(const std::int8_t* weights, const std::int32_t* biases,
+                          const std::uint8_t* input, std::int32_t* output) {
+
+      const __m256i in = _mm256_load_si256(reinterpret_cast<const __m256i*>(input));
+      const __m256i row = _mm256_load_si256(reinterpret_cast<const __m256i*>(weights));
+      const __m256i sum256 = _mm256_dpbusd_epi32(_mm256_setzero_si256(), in, row);
+
+      __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(sum256), _mm256_extracti128_si256(sum256, 1));
+      sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4E)); //_MM_PERM_BADC
+      sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xB1)); //_MM_PERM_CDAB
+      output[0] = _mm_cvtsi128_si32(sum) + biases[0];
+    }
+  };
+
+#endif
+
+  // Affine transformation layer for the small hidden layers. It reads and
+  // writes the same parameters as AffineTransform, and uses the kernel
+  // specialized for its shape, if any.
+  template <typename PreviousLayer, IndexType OutDims>
+  class AffineTransformVnni {
+   public:
+    // Input/output type
+    using InputType = typename PreviousLayer::OutputType;
+    using OutputType = std::int32_t;
+    static_assert(std::is_same<InputType, std::uint8_t>::value, "");
+
+    // Number of input/output dimensions
+    static constexpr IndexType InputDimensions = PreviousLayer::OutputDimensions;
+    static constexpr IndexType OutputDimensions = OutDims;
+    static constexpr IndexType PaddedInputDimensions =
+        ceil_to_multiple<IndexType>(InputDimensions, MaxSimdWidth);
+
+    // Size of forward propagation buffer used in this layer
+    static constexpr std::size_t SelfBufferSize =
+        ceil_to_multiple(OutputDimensions * sizeof(OutputType), CacheLineSize);
+
+    // Size of the forward propagation buffer used from the input layer to this layer
+    static constexpr std::size_t BufferSize =
+        PreviousLayer::BufferSize + SelfBufferSize;
+
+    // Hash value embedded in the evaluation file, the same as AffineTransform
+    static constexpr std::uint32_t get_hash_value() {
+      std::uint32_t hashValue = 0xCC03DAE4u;
+      hashValue += OutputDimensions;
+      hashValue ^= PreviousLayer::get_hash_value() >> 1;
+      hashValue ^= PreviousLayer::get_hash_value() << 31;
+      return hashValue;
+    }
+
+    // Read network parameters
+    bool read_parameters(std::istream& stream) {
+      if (!previousLayer.read_parameters(stream)) return false;
+      for (std::size_t i = 0; i < OutputDimensions; ++i)
+        biases[i] = read_little_endian<BiasType>(stream);
+      for (std::size_t i = 0; i < OutputDimensions * PaddedInputDimensions; ++i)
+        weights[Kernel::get_weight_index(i)] = read_little_endian<WeightType>(stream);
+      return !stream.fail();
+    }
+
+    // Write network parameters
+    bool write_parameters(std::ostream& stream) const {
+      if (!previousLayer.write_parameters(stream)) return false;
+      for (std::size_t i = 0; i < OutputDimensions; ++i)
+          write_little_endian<BiasType>(stream, biases[i]);
+      for (std::size_t i = 0; i < OutputDimensions * PaddedInputDimensions; ++i)
+          write_little_endian<WeightType>(stream, weights[Kernel::get_weight_index(i)]);
+      return !stream.fail();
+    }
+
+    // Forward propagation
+    const OutputType* propagate(
+        const TransformedFeatureType* transformedFeatures, char* buffer) const {
+      const auto input = previousLayer.propagate(
+          transformedFeatures, buffer + SelfBufferSize);
+      auto output = reinterpret_cast<OutputType*>(buffer);
+
+      Kernel::propagate(weights, biases, input, output);
+
+      return output;
+    }
+
+   private:
+    using BiasType = OutputType;
+    using WeightType = std::int8_t;
+    using Kernel = VnniKernel<InputDimensions, OutputDimensions>;
+
+    PreviousLayer previousLayer;
+
+    alignas(CacheLineSize) BiasType biases[OutputDimensions];
+    alignas(CacheLineSize) WeightType weights[OutputDimensions * PaddedInputDimensions];
+  };
+
+}  // namespace Stockfish::Eval::NNUE::Layers
+
+#endif // #ifndef NNUE_LAYERS_AFFINE_TRANSFORM_VNNI_H_INCLUDED
@@ -26,14 +26,21 @@ int main(int argc, char* argv[]) {
   CommandLine::init(argc, argv);
   UCI::init(Options);
   Tune::init();
+  Startup::mark("Options");
   PSQT::init();
+  Startup::mark("PSQT");
   Bitboards::init();
-  Position::init();
+  Startup::mark("Bitboards");
   Bitbases::init();
+  Startup::mark("Bitbases");
   Endgames::init();
+  Startup::mark("Endgames");
   Threads.set(size_t(Options["Threads"]));
+  Startup::mark("Threads");
   Search::clear(); // After threads are up
+  Startup::mark("Search");
   Eval::NNUE::init();
+  Startup::mark("NNUE");
 
   UCI::loop(argc, argv);
 
@@ -107,18 +107,13 @@ namespace {
 namespace Material {
 
 
-/// Material::probe() looks up the current position's material configuration in
-/// the material hash table. It returns a pointer to the Entry if the position
-/// is found. Otherwise a new Entry is computed and stored there, so we don't
-/// have to recompute all when the same material configuration occurs again.
+namespace {
 
-Entry* probe(const Position& pos) {
+/// compute() fills the Entry of the current position's material configuration
 
-  Key key = pos.material_key();
-  Entry* e = pos.this_thread()->materialTable[key];
+void compute(const Position& pos, Entry* e) {
 
-  if (e->key == key)
-      return e;
+  Key key = pos.material_key();
 
   std::memset(e, 0, sizeof(Entry));
   e->key = key;
@@ -135,13 +130,13 @@ Entry* probe(const Position& pos) {
   // material configuration. Firstly we look for a fixed configuration one, then
   // for a generic one if the previous search failed.
   if ((e->evaluationFunction = Endgames::probe<Value>(key)) != nullptr)
-      return e;
+      return;
 
   for (Color c : { WHITE, BLACK })
       if (is_KXK(pos, c))
       {
           e->evaluationFunction = &EvaluateKXK[c];
-          return e;
+          return;
       }
 
   // OK, we didn't find any special evaluation function for the current material
@@ -151,7 +146,7 @@ Entry* probe(const Position& pos) {
   if (sf)
   {
       e->scalingFunction[sf->strongSide] = sf; // Only strong color assigned
-      return e;
+      return;
   }
 
   // We didn't find any specialized scaling function, so fall back on generic
@@ -210,6 +205,28 @@ Entry* probe(const Position& pos) {
     pos.count<BISHOP>(BLACK)    , pos.count<ROOK>(BLACK), pos.count<QUEEN >(BLACK) } };
 
   e->score = (imbalance<WHITE>(pieceCount) - imbalance<BLACK>(pieceCount)) / 16;
+}
+
+} // namespace
+
+
+/// Material::probe() looks up the current position's material configuration in
+/// the material hash table. It returns a pointer to the Entry if the position
+/// is found. Otherwise a new Entry is computed and stored there, so we don't
+/// have to recompute all when the same material configuration occurs again.
+
+Entry* probe(const Position& pos) {
+
+  TableView& material = pos.this_thread()->material;
+  bool found;
+  Entry* e = material.probe(pos.material_key(), found);
+
+  if (found)
+      return e;
+
+  compute(pos, e);
+  material.save(e);
+
   return e;
 }
 
@@ -51,7 +51,8 @@ struct Entry {
   uint8_t factor[COLOR_NB];
 };
 
-typedef HashTable<Entry, 8192> Table;
+typedef HashTable<Entry> Table;
+typedef HashTableView<Entry> TableView;
 
 Entry* probe(const Position& pos);
 
@@ -28,6 +28,7 @@ typedef bool(*fun3_t)(HANDLE, CONST GROUP_AFFINITY*, PGROUP_AFFINITY);
 }
 #endif
 
+#include <algorithm>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
@@ -36,8 +37,19 @@ typedef bool(*fun3_t)(HANDLE, CONST GROUP_AFFINITY*, PGROUP_AFFINITY);
 #include <cstdlib>
 
 #if defined(__linux__) && !defined(__ANDROID__)
+#include <sched.h>
 #include <stdlib.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <process.h>
 #endif
 
 #if defined(__APPLE__) || defined(__ANDROID__) || defined(__OpenBSD__) || (defined(__GLIBCXX__) && !defined(_GLIBCXX_HAVE_ALIGNED_ALLOC) && !defined(_WIN32)) || defined(__e2k__)
@@ -254,6 +266,10 @@ std::string compiler_info() {
     compiler += " DEBUG";
   #endif
 
+  #if defined(FAT_ARCH)
+    compiler += "\nSelected at startup from the engines of a fat binary: " FAT_ARCH;
+  #endif
+
   compiler += "\n__VERSION__ macro expands to: ";
   #ifdef __VERSION__
      compiler += __VERSION__;
@@ -285,6 +301,40 @@ void dbg_print() {
 }
 
 
+/// Startup timing, as recorded by main()
+
+namespace {
+
+  std::chrono::steady_clock::time_point lastMark = std::chrono::steady_clock::now();
+  vector<pair<string, double>> stages; // Stage names and times in milliseconds
+}
+
+void Startup::mark(const string& stage) {
+
+  auto t = std::chrono::steady_clock::now();
+  stages.emplace_back(stage, std::chrono::duration<double, std::milli>(t - lastMark).count());
+  lastMark = t;
+}
+
+void Startup::print() {
+
+  stringstream ss;
+  double total = 0;
+
+  ss << std::fixed << std::setprecision(3);
+
+  for (const auto& [stage, ms] : stages)
+  {
+      ss << std::left << setw(20) << stage << std::right << setw(10) << ms << " ms\n";
+      total += ms;
+  }
+
+  ss << std::left << setw(20) << "Total" << std::right << setw(10) << total << " ms";
+
+  sync_cout << ss.str() << sync_endl;
+}
+
+
 /// Used to serialize access to std::cout to avoid multiple threads writing at
 /// the same time.
 
@@ -312,6 +362,7 @@ void start_logger(const std::string& fname) { Logger::start(fname); }
 #ifdef NO_PREFETCH
 
 void prefetch(void*) {}
+void prefetch_range(const void*, size_t) {}
 
 #else
 
@@ -330,6 +381,19 @@ void prefetch(void* addr) {
 #  endif
 }
 
+
+/// prefetch_range() preloads all the cache lines of the given block of memory,
+/// like a row of weights of the NNUE feature transformer.
+
+void prefetch_range(const void* addr, size_t size) {
+
+  constexpr uintptr_t CacheLineSize = 64;
+
+  const uintptr_t end = reinterpret_cast<uintptr_t>(addr) + size;
+  for (uintptr_t line = reinterpret_cast<uintptr_t>(addr) & ~(CacheLineSize - 1); line < end; line += CacheLineSize)
+      prefetch(reinterpret_cast<void*>(line));
+}
+
 #endif
 
 
@@ -475,11 +539,352 @@ void aligned_large_pages_free(void *mem) {
 #endif
 
 
-namespace WinProcGroup {
+/// map_file() maps the given file read-only and shared, so that all the processes
+/// mapping the same file use the same physical pages of the page cache. It returns
+/// nullptr if the file can not be mapped. The returned mapping must be released
+/// with unmap_file().
+
+void* map_file(const std::string& fname, size_t* size, uint64_t* mapping) {
 
 #ifndef _WIN32
+  struct stat statbuf;
+  int fd = ::open(fname.c_str(), O_RDONLY);
+
+  if (fd == -1)
+      return nullptr;
+
+  if (fstat(fd, &statbuf) == -1 || statbuf.st_size == 0)
+  {
+      ::close(fd);
+      return nullptr;
+  }
+
+  *size = *mapping = statbuf.st_size;
+  void* baseAddress = mmap(nullptr, statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+
+  return baseAddress != MAP_FAILED ? baseAddress : nullptr;
+#else
+  HANDLE fd = CreateFile(fname.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                         OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+  if (fd == INVALID_HANDLE_VALUE)
+      return nullptr;
+
+  DWORD size_high;
+  DWORD size_low = GetFileSize(fd, &size_high);
+  HANDLE mmap = CreateFileMapping(fd, nullptr, PAGE_READONLY, size_high, size_low, nullptr);
+  CloseHandle(fd);
+
+  if (!mmap)
+      return nullptr;
+
+  void* baseAddress = MapViewOfFile(mmap, FILE_MAP_READ, 0, 0, 0);
+  if (!baseAddress)
+  {
+      CloseHandle(mmap);
+      return nullptr;
+  }
+
+  *size = size_t((uint64_t(size_high) << 32) | size_low);
+  *mapping = (uint64_t)mmap;
+  return baseAddress;
+#endif
+}
+
+/// map_file_rw() maps the given file read-write and shared, creating it if needed
+/// and setting its size, so that the writes to the memory end up in the file.
+/// It returns nullptr if the file can not be mapped. The returned mapping must
+/// be released with unmap_file().
+
+void* map_file_rw(const std::string& fname, size_t size, uint64_t* mapping) {
+
+#ifndef _WIN32
+  int fd = ::open(fname.c_str(), O_RDWR | O_CREAT, 0644);
+
+  if (fd == -1)
+      return nullptr;
+
+  if (ftruncate(fd, off_t(size)) == -1)
+  {
+      ::close(fd);
+      return nullptr;
+  }
+
+  *mapping = size;
+  void* baseAddress = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+
+  return baseAddress != MAP_FAILED ? baseAddress : nullptr;
+#else
+  HANDLE fd = CreateFile(fname.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                         nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+  if (fd == INVALID_HANDLE_VALUE)
+      return nullptr;
+
+  // Set the size of the file first, as the mapping can only extend it
+  LARGE_INTEGER end;
+  end.QuadPart = LONGLONG(size);
+  if (!SetFilePointerEx(fd, end, nullptr, FILE_BEGIN) || !SetEndOfFile(fd))
+  {
+      CloseHandle(fd);
+      return nullptr;
+  }
+
+  HANDLE mmap = CreateFileMapping(fd, nullptr, PAGE_READWRITE, DWORD(uint64_t(size) >> 32), DWORD(size), nullptr);
+  CloseHandle(fd);
+
+  if (!mmap)
+      return nullptr;
+
+  void* baseAddress = MapViewOfFile(mmap, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+  if (!baseAddress)
+  {
+      CloseHandle(mmap);
+      return nullptr;
+  }
+
+  *mapping = (uint64_t)mmap;
+  return baseAddress;
+#endif
+}
+
+void unmap_file(void* baseAddress, uint64_t mapping) {
+
+#ifndef _WIN32
+  munmap(baseAddress, mapping);
+#else
+  UnmapViewOfFile(baseAddress);
+  CloseHandle((HANDLE)mapping);
+#endif
+}
+
+
+/// temp_file_name() returns a name for a temporary file next to the given one,
+/// unique to this process. Writing to it and then renaming it to the final name
+/// ensures that other processes never see a partially written file.
+
+std::string temp_file_name(const std::string& fname) {
+
+#ifndef _WIN32
+  return fname + ".tmp" + std::to_string(getpid());
+#else
+  return fname + ".tmp" + std::to_string(_getpid());
+#endif
+}
+
+
+namespace WinProcGroup {
+
+#if defined(__linux__) && !defined(__ANDROID__)
+
+namespace {
+
+  // A NUMA node, with its logical processors and its number of cores
+  struct Node {
+    int id;
+    std::vector<int> cpus;
+    int cores;
+  };
+
+  // read_list() reads a list of numbers in the "0-3,8,10-11" format of sysfs
+  std::vector<int> read_list(const std::string& fname) {
+
+    std::vector<int> list;
+    std::ifstream file(fname);
+    std::string range;
+
+    while (std::getline(file, range, ','))
+    {
+        int first, last;
+        char dash;
+        std::istringstream ss(range);
+
+        if (!(ss >> first))
+            break;
+
+        if (!(ss >> dash >> last))
+            last = first;
+
+        for (int n = first; n <= last; ++n)
+            list.push_back(n);
+    }
+
+    return list;
+  }
+
+  // nodes() reads the NUMA nodes of /sys/devices/system/node once, with the
+  // logical processors of the process only, as given by its affinity when no
+  // thread is bound yet. A core is counted at the first logical processor of
+  // its siblings.
+  const std::vector<Node>& nodes() {
+
+    static const std::vector<Node> list = [] {
+
+        constexpr int MaxCpus = 4096;
+
+        std::vector<Node> v;
+        cpu_set_t* allowed = CPU_ALLOC(MaxCpus);
+        const size_t setSize = CPU_ALLOC_SIZE(MaxCpus);
+
+        if (allowed && sched_getaffinity(0, setSize, allowed) == -1)
+            CPU_FREE(allowed), allowed = nullptr;
+
+        for (int id : read_list("/sys/devices/system/node/online"))
+        {
+            Node node = { id, read_list("/sys/devices/system/node/node" + std::to_string(id) + "/cpulist"), 0 };
+
+            if (allowed)
+                node.cpus.erase(std::remove_if(node.cpus.begin(), node.cpus.end(), [&](int cpu) {
+                                    return cpu >= MaxCpus || !CPU_ISSET_S(cpu, setSize, allowed);
+                                }), node.cpus.end());
+
+            for (int cpu : node.cpus)
+            {
+                std::vector<int> siblings = read_list("/sys/devices/system/cpu/cpu" + std::to_string(cpu)
+                                                    + "/topology/thread_siblings_list");
+                node.cores += siblings.empty() || cpu == *std::min_element(siblings.begin(), siblings.end());
+            }
+
+            if (!node.cpus.empty())
+                v.push_back(node);
+        }
+
+        if (allowed)
+            CPU_FREE(allowed);
+
+        return v;
+    }();
+
+    return list;
+  }
+
+  // best_group() returns the index in nodes() of the node for the thread with
+  // index idx, filled as under Windows: the cores of each node first, then the
+  // other logical processors spread evenly. It returns -1 when the thread is
+  // left to the OS, with a single node or more threads than processors.
+  int best_group(size_t idx) {
+
+    static const std::vector<int> groups = [] {
+
+        std::vector<int> g;
+        size_t threads = 0;
+
+        for (size_t n = 0; n < nodes().size(); ++n)
+        {
+            g.insert(g.end(), nodes()[n].cores, int(n));
+            threads += nodes()[n].cpus.size() - nodes()[n].cores;
+        }
+
+        for (size_t t = 0; t < threads; ++t)
+            g.push_back(int(t % nodes().size()));
+
+        return g;
+    }();
+
+    return nodes().size() > 1 && idx < groups.size() ? groups[idx] : -1;
+  }
+
+  // set_policy() sets the memory policy of the pages of [mem, mem + size) with
+  // the mbind() syscall, moving the pages already there, for the given nodes.
+  // The range is rounded up to pages at both ends, so that consecutive ranges
+  // share out the pages between them.
+  void set_policy(void* mem, size_t size, int mode, const std::vector<int>& nodeIds) {
+
+#if defined(SYS_mbind)
+    constexpr unsigned MPOL_MF_MOVE = 1 << 1;
+    constexpr size_t Bits = 8 * sizeof(unsigned long);
+
+    const uintptr_t page = uintptr_t(sysconf(_SC_PAGESIZE));
+    const uintptr_t begin = (uintptr_t(mem) + page - 1) & ~(page - 1);
+    const uintptr_t end = (uintptr_t(mem) + size + page - 1) & ~(page - 1);
+
+    if (end <= begin || nodeIds.empty())
+        return;
+
+    const int maxId = *std::max_element(nodeIds.begin(), nodeIds.end());
+    std::vector<unsigned long> mask(maxId / Bits + 1);
+
+    for (int id : nodeIds)
+        mask[id / Bits] |= 1UL << (id % Bits);
+
+    syscall(SYS_mbind, begin, end - begin, mode, mask.data(), mask.size() * Bits + 1, MPOL_MF_MOVE);
+#else
+    (void)mem, (void)size, (void)mode, (void)nodeIds;
+#endif
+  }
+
+  constexpr int MPOL_PREFERRED = 1, MPOL_INTERLEAVE = 3;
+
+} // namespace
+
+
+/// best_node() returns the NUMA node bindThisThread() binds the thread with
+/// index idx to, or 0 if the thread is left to the OS.
+
+int best_node(size_t idx) {
+
+  int group = best_group(idx);
+  return group == -1 ? 0 : nodes()[group].id;
+}
+
+
+/// bindThisThread() sets the affinity of the current thread to the logical
+/// processors of its NUMA node the process may run on. The memory it touches
+/// first is then allocated on that node by the default, local, memory policy.
+
+void bindThisThread(size_t idx) {
+
+  int group = best_group(idx);
+
+  if (group == -1)
+      return;
+
+  const std::vector<int>& cpus = nodes()[group].cpus;
+  const int cpuCount = *std::max_element(cpus.begin(), cpus.end()) + 1;
+
+  cpu_set_t* set = CPU_ALLOC(cpuCount);
+  const size_t setSize = CPU_ALLOC_SIZE(cpuCount);
+
+  if (!set)
+      return;
+
+  CPU_ZERO_S(setSize, set);
+  for (int cpu : cpus)
+      CPU_SET_S(cpu, setSize, set);
+
+  sched_setaffinity(0, setSize, set);
+  CPU_FREE(set);
+}
+
+
+/// prefer_node() puts the pages of the given memory on the given NUMA node, or
+/// on another one when the node is full, and interleave() spreads them evenly
+/// over all the nodes.
+
+void prefer_node(void* mem, size_t size, int node) {
+
+  if (nodes().size() > 1)
+      set_policy(mem, size, MPOL_PREFERRED, { node });
+}
+
+void interleave(void* mem, size_t size) {
+
+  std::vector<int> nodeIds;
+  for (const Node& node : nodes())
+      nodeIds.push_back(node.id);
+
+  if (nodeIds.size() > 1)
+      set_policy(mem, size, MPOL_INTERLEAVE, nodeIds);
+}
+
+#elif !defined(_WIN32)
 
 void bindThisThread(size_t) {}
+int best_node(size_t) { return 0; }
+void prefer_node(void*, size_t, int) {}
+void interleave(void*, size_t) {}
 
 #else
 
@@ -554,6 +959,15 @@ int best_group(size_t idx) {
 }
 
 
+/// best_node() returns the NUMA node bindThisThread() binds the thread with
+/// index idx to, or 0 if the thread is left to the OS.
+
+int best_node(size_t idx) {
+
+  return std::max(best_group(idx), 0);
+}
+
+
 /// bindThisThread() set the group affinity of the current thread
 
 void bindThisThread(size_t idx) {
@@ -577,6 +991,9 @@ void bindThisThread(size_t idx) {
       fun3(GetCurrentThread(), &affinity, nullptr);
 }
 
+void prefer_node(void*, size_t, int) {}
+void interleave(void*, size_t) {}
+
 #endif
 
 } // namespace WinProcGroup
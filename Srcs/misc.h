@@ -8,8 +8,11 @@
 #ifndef MISC_H_INCLUDED
 #define MISC_H_INCLUDED
 
+#include <atomic>
 #include <cassert>
 #include <chrono>
+#include <cstring>
+#include <memory>
 #include <ostream>
 #include <string>
 #include <vector>
@@ -22,11 +25,16 @@ namespace Stockfish {
 std::string engine_info(bool to_uci = false);
 std::string compiler_info();
 void prefetch(void* addr);
+void prefetch_range(const void* addr, size_t size);
 void start_logger(const std::string& fname);
 void* std_aligned_alloc(size_t alignment, size_t size);
 void std_aligned_free(void* ptr);
 void* aligned_large_pages_alloc(size_t size); // memory aligned by page size, min alignment: 4096 bytes
 void aligned_large_pages_free(void* mem); // nop if mem == nullptr
+void* map_file(const std::string& fname, size_t* size, uint64_t* mapping); // read-only, nullptr on failure
+void* map_file_rw(const std::string& fname, size_t size, uint64_t* mapping); // read-write, resized to size
+void unmap_file(void* baseAddress, uint64_t mapping);
+std::string temp_file_name(const std::string& fname); // unique per process
 
 void dbg_hit_on(bool b);
 void dbg_hit_on(bool c, bool b);
@@ -40,12 +48,87 @@ inline TimePoint now() {
         (std::chrono::steady_clock::now().time_since_epoch()).count();
 }
 
-template<class Entry, int Size>
-struct HashTable {
-  Entry* operator[](Key key) { return &table[(uint32_t)key & (Size - 1)]; }
+/// HashTable caches the entries of the pawn and material tables, indexed by the
+/// low bits of their key. A table may be shared by all the threads, in which
+/// case entries are copied in and out of it under a sequence number, which a
+/// writer keeps odd while it writes. A reader accepts its copy when the number
+/// was even and unchanged around it, and the key matches. Nobody waits: a reader
+/// sees a concurrent write as a miss, and a writer skips a slot being written.
+template<class Entry>
+class HashTable {
+
+  struct Slot {
+    std::atomic<uint32_t> sequence;
+    Entry entry;
+  };
+
+public:
+  // Allocate the largest power of 2 number of entries that fits in the given
+  // number of bytes, all empty. The table is released if none fits.
+  void resize(size_t bytes) {
+    size_t count = bytes / sizeof(Slot);
+    while (count & (count - 1))
+        count &= count - 1;
+
+    table.reset(count ? new Slot[count]() : nullptr);
+    mask = count - 1;
+  }
+
+  void* address(Key key) const { return &table[key & mask]; }
+
+  // Entry of the key in a table private to the thread, used in place
+  Entry* operator[](Key key) { return &table[key & mask].entry; }
+
+  bool probe(Key key, Entry& e) const {
+    const Slot& slot = table[key & mask];
+    const uint32_t seq = slot.sequence.load(std::memory_order_acquire);
+    if (seq & 1)
+        return false;
+
+    std::memcpy(&e, &slot.entry, sizeof(Entry));
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return slot.sequence.load(std::memory_order_relaxed) == seq && e.key == key;
+  }
+
+  void store(const Entry& e) {
+    Slot& slot = table[e.key & mask];
+    uint32_t seq = slot.sequence.load(std::memory_order_relaxed);
+    if ((seq & 1) || !slot.sequence.compare_exchange_strong(seq, seq + 1, std::memory_order_acquire))
+        return;
+
+    std::atomic_thread_fence(std::memory_order_release);
+    std::memcpy(&slot.entry, &e, sizeof(Entry));
+    slot.sequence.store(seq + 2, std::memory_order_release);
+  }
 
 private:
-  std::vector<Entry> table = std::vector<Entry>(Size); // Allocate on the heap
+  std::unique_ptr<Slot[]> table;
+  size_t mask;
+};
+
+/// HashTableView is the view of a thread on a HashTable, its own or a shared
+/// one, with hit statistics. The entry returned by probe() is the one of the
+/// table when it is private, else the copy of the thread, which the caller
+/// computes in place after a miss and then hands to save().
+template<class Entry>
+struct HashTableView {
+
+  Entry* probe(Key key, bool& found) {
+    Entry* e = shared ? &entry : (*table)[key];
+    found = e->key == key || (shared && table->probe(key, entry));
+    ++probes, hits += found;
+    return e;
+  }
+
+  void save(const Entry* e) {
+    if (shared)
+        table->store(*e);
+  }
+
+  HashTable<Entry>* table = nullptr;
+  bool shared = false;
+  Entry entry = {};
+  uint64_t hits = 0, probes = 0;
 };
 
 
@@ -136,20 +219,20 @@ class PRNG {
 
   uint64_t s;
 
-  uint64_t rand64() {
+  constexpr uint64_t rand64() {
 
     s ^= s >> 12, s ^= s << 25, s ^= s >> 27;
     return s * 2685821657736338717LL;
   }
 
 public:
-  PRNG(uint64_t seed) : s(seed) { assert(seed); }
+  constexpr PRNG(uint64_t seed) : s(seed) { assert(seed); }
 
-  template<typename T> T rand() { return T(rand64()); }
+  template<typename T> constexpr T rand() { return T(rand64()); }
 
   /// Special generator used to fast init magic numbers.
   /// Output values only have 1/8th of their bits set on average.
-  template<typename T> T sparse_rand()
+  template<typename T> constexpr T sparse_rand()
   { return T(rand64() & rand64() & rand64()); }
 };
 
@@ -167,14 +250,40 @@ inline uint64_t mul_hi64(uint64_t a, uint64_t b) {
 #endif
 }
 
+/// checksum() returns an FNV-1a hash of the given words, used to validate the
+/// tables generated into tables.h. Data read in pieces is hashed by passing the
+/// hash of the previous pieces as 'h'.
+
+inline uint64_t checksum(const uint64_t* words, size_t count,
+                         uint64_t h = 14695981039346656037ULL) {
+
+  for (size_t i = 0; i < count; ++i)
+      h = (h ^ words[i]) * 1099511628211ULL;
+  return h;
+}
+
 /// Under Windows it is not possible for a process to run on more than one
 /// logical processor group. This usually means to be limited to use max 64
 /// cores. To overcome this, some special platform specific API should be
 /// called to set group affinity for each thread. Original code from Texel by
-/// Peter Österlund.
+/// Peter Österlund. Under Linux the threads are bound to the NUMA nodes of
+/// /sys/devices/system/node in the same way, and memory can be placed on the
+/// nodes with the mbind() syscall, without libnuma.
 
 namespace WinProcGroup {
   void bindThisThread(size_t idx);
+  int best_node(size_t idx);
+  void prefer_node(void* mem, size_t size, int node); // Linux only
+  void interleave(void* mem, size_t size); // Linux only
+}
+
+/// The Startup namespace times the initialization of the engine, for the
+/// 'startuptime' command. mark() records the time since the previous mark,
+/// or since the program was loaded, under the name of the stage just done.
+
+namespace Startup {
+  void mark(const std::string& stage);
+  void print();
 }
 
 namespace CommandLine {
@@ -10,17 +10,137 @@
 #ifndef NNUE_ACCUMULATOR_H_INCLUDED
 #define NNUE_ACCUMULATOR_H_INCLUDED
 
+#include <memory>
+#include <tuple>
+#include <type_traits>
+
 #include "nnue_architecture.h"
 
+namespace Stockfish {
+  struct StateInfo;
+}
+
 namespace Stockfish::Eval::NNUE {
 
   // Class that holds the result of affine transformation of input features
+  template <typename Arch>
   struct alignas(CacheLineSize) Accumulator {
-    std::int16_t accumulation[2][TransformedFeatureDimensions];
-    std::int32_t psqtAccumulation[2][PSQTBuckets];
+    std::int16_t accumulation[2][Arch::TransformedFeatureDimensions];
+    std::int32_t psqtAccumulation[2][Arch::PSQTBuckets];
     bool computed[2];
+    const StateInfo* state; // The position that last claimed the accumulator
+  };
+
+  // Per-thread stack of accumulators, indexed by the accumulatorIdx of the
+  // StateInfo, which is one more than the one of the previous position. Keeping
+  // the accumulators out of StateInfo keeps the search stack frames small.
+  // An accumulator is only meaningful for the StateInfo that last claimed it,
+  // so that states of the game history, of other threads or that wrapped around
+  // the stack are never mistaken for the position being evaluated.
+  template <typename Arch>
+  struct AccumulatorStack {
+
+    static constexpr int Size = 256;
+    static_assert(Size > MAX_PLY, "The stack must hold a whole search path");
+    static_assert((Size & (Size - 1)) == 0, "Size must be a power of 2");
+
+    Accumulator<Arch>& operator[](int idx) { return entries[idx & (Size - 1)]; }
+
+    // Claim the accumulator of index idx for 'st', with nothing computed yet
+    void claim(int idx, const StateInfo* st) {
+      Accumulator<Arch>& acc = (*this)[idx];
+      acc.state = st;
+      acc.computed[0] = acc.computed[1] = false;
+    }
+
+    void clear() {
+      for (auto& acc : entries)
+          acc.state = nullptr;
+    }
+
+    Accumulator<Arch> entries[Size];
+  };
+
+  // Accumulator of the last position refreshed by a thread for a given king
+  // square and perspective, together with its (sorted) active feature indices.
+  template <typename Arch>
+  struct alignas(CacheLineSize) RefreshEntry {
+    std::int16_t accumulation[Arch::TransformedFeatureDimensions];
+    std::int32_t psqtAccumulation[Arch::PSQTBuckets];
+    ValueList<IndexType, FeatureSet::MaxActiveDimensions> active;
+    bool computed;
+  };
+
+  // Per-thread table of refresh entries. When an accumulator has to be
+  // refreshed (typically after a king move), we start from the entry of the
+  // new king square and only apply the features that differ from the cached
+  // position, instead of rebuilding the accumulator from the biases.
+  template <typename Arch>
+  struct RefreshTable {
+
+    void clear() {
+      for (auto& sq : entries)
+          for (auto& entry : sq)
+              entry.computed = false;
+    }
+
+    RefreshEntry<Arch> entries[SQUARE_NB][COLOR_NB];
   };
 
+  // Accumulator stack and refresh table of a thread for the nets of Arch
+  template <typename Arch>
+  struct ArchitectureCaches {
+    AccumulatorStack<Arch> stack;
+    RefreshTable<Arch> refreshTable;
+  };
+
+  // Accumulator stack and refresh table of a thread. They are only allocated,
+  // by use() when the net is loaded, for the architecture of the net in use,
+  // those of the other architectures being freed. Until then the positions
+  // claim nothing.
+  template <typename... Archs>
+  struct AccumulatorCaches {
+
+    template <typename Arch>
+    AccumulatorStack<Arch>& stack() { return caches<Arch>()->stack; }
+
+    template <typename Arch>
+    RefreshTable<Arch>& refresh_table() { return caches<Arch>()->refreshTable; }
+
+    // Claim the accumulator of index idx for 'st' in the stack in use
+    void claim(int idx, const StateInfo* st) {
+      std::size_t i = 0;
+      ((i++ == active ? caches<Archs>()->stack.claim(idx, st) : void()), ...);
+    }
+
+    // Select the caches of Arch, with nothing cached
+    template <typename Arch>
+    void use() {
+      std::size_t i = 0;
+      ((std::is_same<Arch, Archs>::value ? void(active = i) : caches<Archs>().reset(), ++i), ...);
+
+      if (!caches<Arch>())
+          caches<Arch>() = std::make_unique<ArchitectureCaches<Arch>>();
+
+      clear();
+    }
+
+    void clear() {
+      ((caches<Archs>() ? caches<Archs>()->stack.clear(), caches<Archs>()->refreshTable.clear() : void()), ...);
+    }
+
+  private:
+    template <typename Arch>
+    std::unique_ptr<ArchitectureCaches<Arch>>& caches() {
+      return std::get<std::unique_ptr<ArchitectureCaches<Arch>>>(perArchitecture);
+    }
+
+    std::tuple<std::unique_ptr<ArchitectureCaches<Archs>>...> perArchitecture;
+    std::size_t active = sizeof...(Archs); // None until use() is called
+  };
+
+  using ThreadAccumulators = ForEachArchitecture<AccumulatorCaches>;
+
 }  // namespace Stockfish::Eval::NNUE
 
 #endif // NNUE_ACCUMULATOR_H_INCLUDED
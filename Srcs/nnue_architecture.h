@@ -16,6 +16,10 @@
 
 #include "layers/input_slice.h"
 #include "layers/affine_transform.h"
+#include "layers/affine_transform_vnni.h"
+#if defined(USE_SSSE3)
+#include "layers/affine_transform_sparse_input.h"
+#endif
 #include "layers/clipped_relu.h"
 
 namespace Stockfish::Eval::NNUE {
@@ -23,26 +27,70 @@ namespace Stockfish::Eval::NNUE {
   // Input features used in evaluation function
   using FeatureSet = Features::HalfKAv2;
 
-  // Number of input feature dimensions after conversion
-  constexpr IndexType TransformedFeatureDimensions = 512;
-  constexpr IndexType PSQTBuckets = 8;
-  constexpr IndexType LayerStacks = 8;
-
   namespace Layers {
 
-    // Define network structure
-    using InputLayer = InputSlice<TransformedFeatureDimensions * 2>;
-    using HiddenLayer1 = ClippedReLU<AffineTransform<InputLayer, 16>>;
-    using HiddenLayer2 = ClippedReLU<AffineTransform<HiddenLayer1, 32>>;
-    using OutputLayer = AffineTransform<HiddenLayer2, 1>;
+    // Affine transformation used for the first hidden layer. Its input, the
+    // clipped output of the feature transformer, is mostly zero, so where
+    // the SIMD compare/movemask is cheap we multiply only the non-zero inputs.
+  #if defined(USE_SSSE3)
+    template <typename PreviousLayer, IndexType OutDims>
+    using FirstAffineTransform = AffineTransformSparseInput<PreviousLayer, OutDims>;
+  #else
+    template <typename PreviousLayer, IndexType OutDims>
+    using FirstAffineTransform = AffineTransform<PreviousLayer, OutDims>;
+  #endif
+
+    // Affine transformation used for the second hidden layer and the output
+    // layer, whose small shapes have dedicated vpdpbusd kernels when VNNI is
+    // available.
+  #if defined(USE_VNNI)
+    template <typename PreviousLayer, IndexType OutDims>
+    using SmallAffineTransform = AffineTransformVnni<PreviousLayer, OutDims>;
+  #else
+    template <typename PreviousLayer, IndexType OutDims>
+    using SmallAffineTransform = AffineTransform<PreviousLayer, OutDims>;
+  #endif
 
   }  // namespace Layers
 
-  using Network = Layers::OutputLayer;
+  // Shape of a network: the number of input feature dimensions after conversion,
+  // of PSQT buckets and of layer stacks. Several architectures are built into
+  // the engine, and the one of a net is recognized from the hash of its header.
+  template <IndexType TransformedDims, IndexType NumPSQTBuckets, IndexType NumLayerStacks>
+  struct Architecture {
+
+    static constexpr IndexType TransformedFeatureDimensions = TransformedDims;
+    static constexpr IndexType PSQTBuckets = NumPSQTBuckets;
+    static constexpr IndexType LayerStacks = NumLayerStacks;
+
+    // Define network structure
+    using InputLayer = Layers::InputSlice<TransformedFeatureDimensions * 2>;
+    using HiddenLayer1 = Layers::ClippedReLU<Layers::FirstAffineTransform<InputLayer, 16>>;
+    using HiddenLayer2 = Layers::ClippedReLU<Layers::SmallAffineTransform<HiddenLayer1, 32>>;
+    using OutputLayer = Layers::SmallAffineTransform<HiddenLayer2, 1>;
+
+    using Network = OutputLayer;
+
+    static_assert(TransformedFeatureDimensions % MaxSimdWidth == 0, "");
+    static_assert(Network::OutputDimensions == 1, "");
+    static_assert(std::is_same<typename Network::OutputType, std::int32_t>::value, "");
+  };
+
+  // The standard net, and a half-width net that costs about half as much to
+  // update, for very fast games and for cheap evaluations in bulk.
+  using DefaultArchitecture = Architecture<512, 8, 8>;
+  using SpeedArchitecture   = Architecture<256, 8, 8>;
+
+  // Instantiate T for all the architectures built into the engine
+  template <template <typename...> class T>
+  using ForEachArchitecture = T<DefaultArchitecture, SpeedArchitecture>;
+
+  // Shape of the default architecture
+  constexpr IndexType TransformedFeatureDimensions = DefaultArchitecture::TransformedFeatureDimensions;
+  constexpr IndexType PSQTBuckets = DefaultArchitecture::PSQTBuckets;
+  constexpr IndexType LayerStacks = DefaultArchitecture::LayerStacks;
 
-  static_assert(TransformedFeatureDimensions % MaxSimdWidth == 0, "");
-  static_assert(Network::OutputDimensions == 1, "");
-  static_assert(std::is_same<Network::OutputType, std::int32_t>::value, "");
+  using Network = DefaultArchitecture::Network;
 
 }  // namespace Stockfish::Eval::NNUE
 
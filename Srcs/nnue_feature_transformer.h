@@ -13,7 +13,14 @@
 #include "nnue_common.h"
 #include "nnue_architecture.h"
 
+#include "../thread.h"
+
+#include <algorithm> // std::sort()
+#include <cstdio> // std::rename()
 #include <cstring> // std::memset()
+#include <fstream>
+#include <string>
+#include <vector>
 
 namespace Stockfish::Eval::NNUE {
 
@@ -26,9 +33,6 @@ namespace Stockfish::Eval::NNUE {
   // vector registers.
   #define VECTOR
 
-  static_assert(PSQTBuckets % 8 == 0,
-    "Per feature PSQT values cannot be processed at granularity lower than 8 at a time.");
-
   #ifdef USE_AVX512
   typedef __m512i vec_t;
   typedef __m256i psqt_vec_t;
@@ -143,23 +147,31 @@ namespace Stockfish::Eval::NNUE {
           return 1;
       }
 
-      static constexpr int NumRegs     = BestRegisterCount<vec_t, WeightType, TransformedFeatureDimensions, NumRegistersSIMD>();
-      static constexpr int NumPsqtRegs = BestRegisterCount<psqt_vec_t, PSQTWeightType, PSQTBuckets, NumRegistersSIMD>();
-
       #pragma GCC diagnostic pop
 
   #endif
 
 
 
-  // Input feature converter
-  class FeatureTransformer {
+  // Input feature converter of the nets of architecture Arch
+  template <typename Arch>
+  class BasicFeatureTransformer {
 
    private:
     // Number of output dimensions for one side
-    static constexpr IndexType HalfDimensions = TransformedFeatureDimensions;
+    static constexpr IndexType HalfDimensions = Arch::TransformedFeatureDimensions;
+    static constexpr IndexType PSQTBuckets = Arch::PSQTBuckets;
+
+    static_assert(PSQTBuckets % 8 == 0,
+      "Per feature PSQT values cannot be processed at granularity lower than 8 at a time.");
 
     #ifdef VECTOR
+    #pragma GCC diagnostic push
+    #pragma GCC diagnostic ignored "-Wignored-attributes"
+    static constexpr int NumRegs     = BestRegisterCount<vec_t, WeightType, HalfDimensions, NumRegistersSIMD>();
+    static constexpr int NumPsqtRegs = BestRegisterCount<psqt_vec_t, PSQTWeightType, PSQTBuckets, NumRegistersSIMD>();
+    #pragma GCC diagnostic pop
+
     static constexpr IndexType TileHeight = NumRegs * sizeof(vec_t) / 2;
     static constexpr IndexType PsqtTileHeight = NumPsqtRegs * sizeof(psqt_vec_t) / 4;
     static_assert(HalfDimensions % TileHeight == 0, "TileHeight must divide HalfDimensions");
@@ -183,34 +195,100 @@ namespace Stockfish::Eval::NNUE {
       return FeatureSet::HashValue ^ OutputDimensions;
     }
 
+    // Size in bytes of the weights, which are stored in a single block
+    static constexpr std::size_t WeightsSize     = HalfDimensions * InputDimensions * sizeof(WeightType);
+    static constexpr std::size_t PsqtWeightsSize = InputDimensions * PSQTBuckets * sizeof(PSQTWeightType);
+
+    // Weight image used by the next call to read_parameters(), if not empty.
+    // The image holds the weights laid out exactly as in memory, so it can be
+    // mapped read-only and shared by all the engine processes of the host.
+    // It is written next to the net the first time the net is loaded.
+    static inline std::string ImageFile;
+
+    ~BasicFeatureTransformer() { release_weights(); }
+
     // Read network parameters
     bool read_parameters(std::istream& stream) {
 
-      read_little_endian<BiasType      >(stream, biases     , HalfDimensions                  );
+      release_weights();
+      read_little_endian<BiasType>(stream, biases, HalfDimensions);
+      permute_blocks(biases, HalfDimensions, false);
+
+      // An image is only used if it was written from the same weights, which
+      // are read a first time to be hashed and again if there is no such image.
+      std::uint64_t payloadChecksum = 0;
+      if (!ImageFile.empty())
+      {
+          const std::streampos payload = stream.tellg();
+          if (payload != std::streampos(-1) && payload_checksum(stream, &payloadChecksum))
+          {
+              if (map_image(payloadChecksum))
+                  return true;
+
+              stream.seekg(payload);
+          }
+          else
+              stream.setstate(std::ios::failbit);
+      }
+
+      weights = static_cast<WeightType*>(aligned_large_pages_alloc(WeightsSize + PsqtWeightsSize));
+      if (!weights)
+          return false;
+
+      storage = weights;
+
+      psqtWeights = reinterpret_cast<PSQTWeightType*>(reinterpret_cast<char*>(weights) + WeightsSize);
+
       read_little_endian<WeightType    >(stream, weights    , HalfDimensions * InputDimensions);
       read_little_endian<PSQTWeightType>(stream, psqtWeights, PSQTBuckets    * InputDimensions);
 
-      return !stream.fail();
+      if (stream.fail())
+          return false;
+
+      permute_blocks(weights, HalfDimensions * InputDimensions, false);
+
+      // Write the image for the next processes, then switch to it ourselves
+      if (!ImageFile.empty() && write_image(payloadChecksum))
+      {
+          void* owned = storage;
+          if (map_image(payloadChecksum))
+              aligned_large_pages_free(owned);
+      }
+
+      return true;
     }
 
     // Write network parameters
     bool write_parameters(std::ostream& stream) const {
 
-      write_little_endian<BiasType      >(stream, biases     , HalfDimensions                  );
-      write_little_endian<WeightType    >(stream, weights    , HalfDimensions * InputDimensions);
-      write_little_endian<PSQTWeightType>(stream, psqtWeights, PSQTBuckets    * InputDimensions);
+      // Undo the load-time permutation one column at a time, since
+      // the weights may live in a read-only mapping.
+      BiasType column[HalfDimensions];
+
+      std::memcpy(column, biases, sizeof(column));
+      permute_blocks(column, HalfDimensions, true);
+      write_little_endian<BiasType>(stream, column, HalfDimensions);
+
+      for (IndexType i = 0; i < InputDimensions; ++i)
+      {
+          std::memcpy(column, &weights[i * HalfDimensions], sizeof(column));
+          permute_blocks(column, HalfDimensions, true);
+          write_little_endian<WeightType>(stream, column, HalfDimensions);
+      }
+
+      write_little_endian<PSQTWeightType>(stream, psqtWeights, PSQTBuckets * InputDimensions);
 
       return !stream.fail();
     }
 
     // Convert input features
     std::int32_t transform(const Position& pos, OutputType* output, int bucket) const {
-      update_accumulator(pos, WHITE);
-      update_accumulator(pos, BLACK);
+      update_accumulators(pos);
 
       const Color perspectives[2] = {pos.side_to_move(), ~pos.side_to_move()};
-      const auto& accumulation = pos.state()->accumulator.accumulation;
-      const auto& psqtAccumulation = pos.state()->accumulator.psqtAccumulation;
+      const auto& accumulator = pos.accumulators().stack<Arch>()[pos.state()->accumulatorIdx];
+      const auto& accumulation = accumulator.accumulation;
+      const auto& psqtAccumulation = accumulator.psqtAccumulation;
 
       const auto psqt = (
             psqtAccumulation[perspectives[0]][bucket]
@@ -222,7 +300,6 @@ namespace Stockfish::Eval::NNUE {
 
       constexpr IndexType NumChunks = HalfDimensions / (SimdWidth * 2);
       static_assert(HalfDimensions % (SimdWidth * 2) == 0);
-      const __m512i Control = _mm512_setr_epi64(0, 2, 4, 6, 1, 3, 5, 7);
       const __m512i Zero = _mm512_setzero_si512();
 
       for (IndexType p = 0; p < 2; ++p)
@@ -236,8 +313,7 @@ namespace Stockfish::Eval::NNUE {
               __m512i sum1 = _mm512_load_si512(&reinterpret_cast<const __m512i*>
                                               (accumulation[perspectives[p]])[j * 2 + 1]);
 
-              _mm512_store_si512(&out[j], _mm512_permutexvar_epi64(Control,
-                                 _mm512_max_epi8(_mm512_packs_epi16(sum0, sum1), Zero)));
+              _mm512_store_si512(&out[j], _mm512_max_epi8(_mm512_packs_epi16(sum0, sum1), Zero));
           }
       }
       return psqt;
@@ -245,7 +321,6 @@ namespace Stockfish::Eval::NNUE {
   #elif defined(USE_AVX2)
 
       constexpr IndexType NumChunks = HalfDimensions / SimdWidth;
-      constexpr int Control = 0b11011000;
       const __m256i Zero = _mm256_setzero_si256();
 
       for (IndexType p = 0; p < 2; ++p)
@@ -259,8 +334,7 @@ namespace Stockfish::Eval::NNUE {
               __m256i sum1 = _mm256_load_si256(&reinterpret_cast<const __m256i*>
                                               (accumulation[perspectives[p]])[j * 2 + 1]);
 
-              _mm256_store_si256(&out[j], _mm256_permute4x64_epi64(
-                                 _mm256_max_epi8(_mm256_packs_epi16(sum0, sum1), Zero), Control));
+              _mm256_store_si256(&out[j], _mm256_max_epi8(_mm256_packs_epi16(sum0, sum1), Zero));
           }
       }
       return psqt;
@@ -350,76 +424,378 @@ namespace Stockfish::Eval::NNUE {
 
    } // end of function transform()
 
+    // Copy the parameters of 'source' into weights of our own. Used to keep a
+    // copy of the net in the memory of each NUMA node, the weights being first
+    // touched by the calling thread.
+    bool replicate(const BasicFeatureTransformer& source) {
+
+      release_weights();
+      storage = aligned_large_pages_alloc(WeightsSize + PsqtWeightsSize);
+      if (!storage)
+          return false;
+
+      std::memcpy(biases, source.biases, sizeof(biases));
+      weights = static_cast<WeightType*>(storage);
+      psqtWeights = reinterpret_cast<PSQTWeightType*>(static_cast<char*>(storage) + WeightsSize);
+      std::memcpy(weights, source.weights, WeightsSize);
+      std::memcpy(psqtWeights, source.psqtWeights, PsqtWeightsSize);
+      return true;
+    }
 
+    // Preload the weight and PSQT rows of the features changed by the last
+    // move, which the incremental update of the accumulators will read at the
+    // next evaluation. The weights are too large to stay in cache, so this
+    // hides part of the miss latency behind the rest of the node. A king move
+    // refreshes the accumulator of its perspective instead, so it is skipped.
+    void prefetch_changed_features(const Position& pos) const {
 
-   private:
-    void update_accumulator(const Position& pos, const Color perspective) const {
+      StateInfo* st = pos.state();
 
-      // The size must be enough to contain the largest possible update.
-      // That might depend on the feature set and generally relies on the
-      // feature set's update cost calculation to be correct and never
-      // allow updates with more added/removed features than MaxActiveDimensions.
-      using IndexList = ValueList<IndexType, FeatureSet::MaxActiveDimensions>;
+      for (Color perspective : { WHITE, BLACK })
+      {
+          if (FeatureSet::requires_refresh(st, perspective))
+              continue;
 
-  #ifdef VECTOR
-      // Gcc-10.2 unnecessarily spills AVX2 registers if this array
-      // is defined in the VECTOR code below, once in each branch
-      vec_t acc[NumRegs];
-      psqt_vec_t psqt[NumPsqtRegs];
+          IndexList removed, added;
+          FeatureSet::append_changed_indices(
+            pos.square<KING>(perspective), st, perspective, removed, added);
+
+          for (const auto index : removed)
+              prefetch_feature(index);
+          for (const auto index : added)
+              prefetch_feature(index);
+      }
+    }
+
+    // Kernels timed one at a time by nnuebench. The first one rebuilds the
+    // accumulators of the position from the biases, bypassing the refresh
+    // table. The second one updates them from those of the previous position,
+    // which must be computed, as the search does after a move.
+    void refresh_from_biases(const Position& pos) const {
+
+      auto& caches = pos.accumulators();
+      caches.stack<Arch>().claim(pos.state()->accumulatorIdx, pos.state());
+
+      for (Color perspective : { WHITE, BLACK })
+      {
+          caches.refresh_table<Arch>().entries[pos.square<KING>(perspective)][perspective].computed = false;
+          refresh_accumulator(pos, perspective);
+      }
+    }
+
+    void update_from_previous(const Position& pos) const {
+
+      pos.accumulators().stack<Arch>().claim(pos.state()->accumulatorIdx, pos.state());
+      update_accumulators(pos);
+    }
+
+
+
+   private:
+    // Order in which the 128-bit blocks of each 1024-bit chunk of the biases
+    // and of the weight columns are kept in memory. The packs instructions in
+    // transform() interleave the 128-bit lanes of their two operands, so with
+    // this order their result is already in natural order and no lane-crossing
+    // shuffle is needed. Block i in memory holds the original block Order[i].
+  #if defined(USE_AVX512)
+    static constexpr IndexType PackusEpi16Order[8] = { 0, 2, 4, 6, 1, 3, 5, 7 };
+  #elif defined(USE_AVX2)
+    static constexpr IndexType PackusEpi16Order[8] = { 0, 2, 1, 3, 4, 6, 5, 7 };
+  #else
+    static constexpr IndexType PackusEpi16Order[8] = { 0, 1, 2, 3, 4, 5, 6, 7 };
   #endif
 
-      // Look for a usable accumulator of an earlier position. We keep track
-      // of the estimated gain in terms of features to be added/subtracted.
-      StateInfo *st = pos.state(), *next = nullptr;
+    static constexpr IndexType PermuteBlockSize = 16 / sizeof(BiasType);
+    static constexpr IndexType PermuteChunkSize = 8 * PermuteBlockSize;
+    static_assert(HalfDimensions % PermuteChunkSize == 0, "Chunks must divide HalfDimensions");
+
+    static constexpr bool is_identity_order() {
+      for (IndexType i = 0; i < 8; ++i)
+          if (PackusEpi16Order[i] != i)
+              return false;
+      return true;
+    }
+
+    // Permute 'count' values to (or back from, if 'inverse') the in-memory order
+    static void permute_blocks(BiasType* data, std::size_t count, bool inverse) {
+
+      if constexpr (is_identity_order())
+          return;
+
+      BiasType chunk[PermuteChunkSize];
+      for (std::size_t i = 0; i < count; i += PermuteChunkSize)
+      {
+          for (IndexType b = 0; b < 8; ++b)
+          {
+              const IndexType from = inverse ? b : PackusEpi16Order[b];
+              const IndexType to   = inverse ? PackusEpi16Order[b] : b;
+              std::memcpy(&chunk[to * PermuteBlockSize], &data[i + from * PermuteBlockSize],
+                          PermuteBlockSize * sizeof(BiasType));
+          }
+          std::memcpy(&data[i], chunk, sizeof(chunk));
+      }
+    }
+
+    // Layout of the weight image: a header, padded to a page, followed by the
+    // weights and the PSQT weights. ImageVersion must be bumped whenever the
+    // in-memory layout of the weights changes.
+    static constexpr char          ImageMagic[8] = { 'N', 'N', 'U', 'E', 'F', 'T', 'I', 'M' };
+    static constexpr std::uint32_t ImageVersion = 3;
+    static constexpr std::size_t   ImageHeaderSize = 4096;
+
+    struct ImageHeader {
+      char          magic[8];
+      std::uint32_t version;
+      std::uint32_t hashValue;
+      IndexType     order[8]; // PackusEpi16Order of the build that wrote the image
+      std::uint64_t weightsSize;
+      std::uint64_t psqtWeightsSize;
+      std::uint64_t payloadChecksum; // Of the weights in the net file, see payload_checksum()
+      BiasType      biases[HalfDimensions]; // Identifies the net the image was written from
+    };
+
+    static_assert(sizeof(ImageHeader) <= ImageHeaderSize, "Image header must fit in ImageHeaderSize");
+
+    // Hash the weights and PSQT weights of the net, as stored in the stream,
+    // leaving the stream after them.
+    static bool payload_checksum(std::istream& stream, std::uint64_t* sum) {
+
+      constexpr std::size_t PayloadWords = (WeightsSize + PsqtWeightsSize) / sizeof(std::uint64_t);
+      static_assert(PayloadWords * sizeof(std::uint64_t) == WeightsSize + PsqtWeightsSize,
+                    "The payload must be made of whole words");
+
+      std::vector<std::uint64_t> chunk(1 << 16);
+      std::uint64_t h = checksum(nullptr, 0);
+
+      for (std::size_t done = 0; done < PayloadWords; )
+      {
+          const std::size_t n = std::min(chunk.size(), PayloadWords - done);
+          stream.read(reinterpret_cast<char*>(chunk.data()), n * sizeof(std::uint64_t));
+          if (stream.fail())
+              return false;
+
+          h = checksum(chunk.data(), n, h);
+          done += n;
+      }
+
+      *sum = h;
+      return true;
+    }
+
+    // Map ImageFile and use its weights if it matches the biases just read and
+    // the checksum of the weights of the net.
+    bool map_image(std::uint64_t payloadChecksum) {
+
+      std::size_t size;
+      std::uint64_t mapping;
+      void* base = map_file(ImageFile, &size, &mapping);
+      if (!base)
+          return false;
+
+      const auto header = reinterpret_cast<const ImageHeader*>(base);
+      if (   size != ImageHeaderSize + WeightsSize + PsqtWeightsSize
+          || std::memcmp(header->magic, ImageMagic, sizeof(ImageMagic))
+          || header->version != ImageVersion
+          || header->hashValue != get_hash_value()
+          || std::memcmp(header->order, PackusEpi16Order, sizeof(PackusEpi16Order))
+          || header->weightsSize != WeightsSize
+          || header->psqtWeightsSize != PsqtWeightsSize
+          || header->payloadChecksum != payloadChecksum
+          || std::memcmp(header->biases, biases, sizeof(biases)))
+      {
+          unmap_file(base, mapping);
+          return false;
+      }
+
+      storage = base;
+      image = base;
+      imageMapping = mapping;
+      weights = reinterpret_cast<WeightType*>(static_cast<char*>(base) + ImageHeaderSize);
+      psqtWeights = reinterpret_cast<PSQTWeightType*>(reinterpret_cast<char*>(weights) + WeightsSize);
+      return true;
+    }
+
+    // Write ImageFile from the weights in memory. We write to a temporary file
+    // first, so that concurrently starting processes never map a partial image.
+    bool write_image(std::uint64_t payloadChecksum) const {
+
+      ImageHeader header;
+      std::memset(&header, 0, sizeof(header));
+      std::memcpy(header.magic, ImageMagic, sizeof(ImageMagic));
+      header.version = ImageVersion;
+      header.hashValue = get_hash_value();
+      std::memcpy(header.order, PackusEpi16Order, sizeof(PackusEpi16Order));
+      header.weightsSize = WeightsSize;
+      header.psqtWeightsSize = PsqtWeightsSize;
+      header.payloadChecksum = payloadChecksum;
+      std::memcpy(header.biases, biases, sizeof(biases));
+
+      const std::string tmpFile = temp_file_name(ImageFile);
+      std::ofstream stream(tmpFile, std::ios::binary);
+      const char padding[ImageHeaderSize - sizeof(ImageHeader)] = {};
+
+      stream.write(reinterpret_cast<const char*>(&header), sizeof(header));
+      stream.write(padding, sizeof(padding));
+      stream.write(reinterpret_cast<const char*>(weights), WeightsSize + PsqtWeightsSize);
+      stream.close();
+
+      if (stream.fail() || std::rename(tmpFile.c_str(), ImageFile.c_str()))
+      {
+          std::remove(tmpFile.c_str());
+          return false;
+      }
+
+      return true;
+    }
+
+    // Free the block of our weights, if any
+    void release_weights() {
+
+      if (image)
+          unmap_file(image, imageMapping);
+      else if (storage)
+          aligned_large_pages_free(storage);
+
+      storage = image = nullptr;
+      weights = nullptr;
+      psqtWeights = nullptr;
+    }
+
+    // The size must be enough to contain the largest possible update.
+    // That might depend on the feature set and generally relies on the
+    // feature set's update cost calculation to be correct and never
+    // allow updates with more added/removed features than MaxActiveDimensions.
+    using IndexList = ValueList<IndexType, FeatureSet::MaxActiveDimensions>;
+
+    void prefetch_feature(IndexType index) const {
+      prefetch_range(&weights[index * HalfDimensions], HalfDimensions * sizeof(WeightType));
+      prefetch_range(&psqtWeights[index * PSQTBuckets], PSQTBuckets * sizeof(PSQTWeightType));
+    }
+
+    // Bring the accumulators of both perspectives up to date. When both are
+    // stale and can be updated from the same earlier position, we update them
+    // together so that the path to that position is walked only once and the
+    // weight tiles of both perspectives are processed in the same loop.
+    void update_accumulators(const Position& pos) const {
+
+      auto& accumulators = pos.accumulators().stack<Arch>();
+
+      // The accumulator of the current position may still belong to another one
+      if (accumulators[pos.state()->accumulatorIdx].state != pos.state())
+          accumulators.claim(pos.state()->accumulatorIdx, pos.state());
+
+      StateInfo* next[2];
+      StateInfo* st[2] = { find_usable_accumulator(pos, WHITE, next[WHITE]),
+                           find_usable_accumulator(pos, BLACK, next[BLACK]) };
+
+      if (   st[WHITE] == st[BLACK]
+          && next[WHITE] == next[BLACK]
+          && next[WHITE] != nullptr
+          && accumulators[st[WHITE]->accumulatorIdx].computed[WHITE]
+          && accumulators[st[WHITE]->accumulatorIdx].computed[BLACK])
+      {
+          constexpr Color perspectives[2] = { WHITE, BLACK };
+          update_accumulator_incremental<2>(pos, perspectives, st[WHITE], next[WHITE]);
+          return;
+      }
+
+      for (Color perspective : { WHITE, BLACK })
+      {
+          if (!accumulators[st[perspective]->accumulatorIdx].computed[perspective])
+              refresh_accumulator(pos, perspective);
+
+          else if (next[perspective] != nullptr)
+              update_accumulator_incremental<1>(pos, &perspective, st[perspective], next[perspective]);
+      }
+    }
+
+    // Look for a usable accumulator of an earlier position. We keep track
+    // of the estimated gain in terms of features to be added/subtracted.
+    // Returns the state where the search stopped and sets 'next' to the
+    // state following it on the path to the current position. We never walk
+    // past a state whose accumulator has been claimed by another position.
+    StateInfo* find_usable_accumulator(const Position& pos, const Color perspective, StateInfo*& next) const {
+
+      auto& accumulators = pos.accumulators().stack<Arch>();
+      StateInfo *st = pos.state();
       int gain = FeatureSet::refresh_cost(pos);
-      while (st->previous && !st->accumulator.computed[perspective])
+      next = nullptr;
+      while (st->previous && !accumulators[st->accumulatorIdx].computed[perspective])
       {
         // This governs when a full feature refresh is needed and how many
         // updates are better than just one full refresh.
         if (   FeatureSet::requires_refresh(st, perspective)
-            || (gain -= FeatureSet::update_cost(st) + 1) < 0)
+            || (gain -= FeatureSet::update_cost(st) + 1) < 0
+            || accumulators[st->previous->accumulatorIdx].state != st->previous)
           break;
         next = st;
         st = st->previous;
       }
 
-      if (st->accumulator.computed[perspective])
-      {
-        if (next == nullptr)
-          return;
+      return st;
+    }
+
+    // Update incrementally, for each of the given perspectives, the accumulators
+    // of 'next' and of the current position from the computed accumulator of 'st'.
+    template<int NumPerspectives>
+    void update_accumulator_incremental(const Position& pos, const Color* perspectives,
+                                        StateInfo* st, StateInfo* next) const {
+
+  #ifdef VECTOR
+      // Gcc-10.2 unnecessarily spills AVX2 registers if this array
+      // is defined in the VECTOR code below, once in each branch
+      vec_t acc[NumRegs];
+      psqt_vec_t psqt[NumPsqtRegs];
+  #endif
 
-        // Update incrementally in two steps. First, we update the "next"
-        // accumulator. Then, we update the current accumulator (pos.state()).
+      // Update incrementally in two steps. First, we update the "next"
+      // accumulator. Then, we update the current accumulator (pos.state()).
 
-        // Gather all features to be updated.
-        const Square ksq = pos.square<KING>(perspective);
-        IndexList removed[2], added[2];
+      // Gather all features to be updated, walking back from the current
+      // position only once for all perspectives.
+      Square ksq[NumPerspectives];
+      IndexList removed[NumPerspectives][2], added[NumPerspectives][2];
+      for (int p = 0; p < NumPerspectives; ++p)
+      {
+        ksq[p] = pos.square<KING>(perspectives[p]);
         FeatureSet::append_changed_indices(
-          ksq, next, perspective, removed[0], added[0]);
-        for (StateInfo *st2 = pos.state(); st2 != next; st2 = st2->previous)
+          ksq[p], next, perspectives[p], removed[p][0], added[p][0]);
+      }
+      for (StateInfo *st2 = pos.state(); st2 != next; st2 = st2->previous)
+        for (int p = 0; p < NumPerspectives; ++p)
           FeatureSet::append_changed_indices(
-            ksq, st2, perspective, removed[1], added[1]);
+            ksq[p], st2, perspectives[p], removed[p][1], added[p][1]);
+
+      auto& accumulators = pos.accumulators().stack<Arch>();
+      Accumulator<Arch>& source = accumulators[st->accumulatorIdx];
 
-        // Mark the accumulators as computed.
-        next->accumulator.computed[perspective] = true;
-        pos.state()->accumulator.computed[perspective] = true;
+      // Mark the accumulators as computed.
+      for (int p = 0; p < NumPerspectives; ++p)
+      {
+        accumulators[next->accumulatorIdx].computed[perspectives[p]] = true;
+        accumulators[pos.state()->accumulatorIdx].computed[perspectives[p]] = true;
+      }
 
-        // Now update the accumulators listed in states_to_update[], where the last element is a sentinel.
-        StateInfo *states_to_update[3] =
-          { next, next == pos.state() ? nullptr : pos.state(), nullptr };
+      // Now update the accumulators listed in accumulators_to_update[], where the last element is a sentinel.
+      Accumulator<Arch>* accumulators_to_update[3] =
+        { &accumulators[next->accumulatorIdx],
+          next == pos.state() ? nullptr : &accumulators[pos.state()->accumulatorIdx], nullptr };
   #ifdef VECTOR
-        for (IndexType j = 0; j < HalfDimensions / TileHeight; ++j)
+      for (IndexType j = 0; j < HalfDimensions / TileHeight; ++j)
+        for (int p = 0; p < NumPerspectives; ++p)
         {
+          const Color perspective = perspectives[p];
+
           // Load accumulator
           auto accTile = reinterpret_cast<vec_t*>(
-            &st->accumulator.accumulation[perspective][j * TileHeight]);
+            &source.accumulation[perspective][j * TileHeight]);
           for (IndexType k = 0; k < NumRegs; ++k)
             acc[k] = vec_load(&accTile[k]);
 
-          for (IndexType i = 0; states_to_update[i]; ++i)
+          for (IndexType i = 0; accumulators_to_update[i]; ++i)
           {
             // Difference calculation for the deactivated features
-            for (const auto index : removed[i])
+            for (const auto index : removed[p][i])
             {
               const IndexType offset = HalfDimensions * index + j * TileHeight;
               auto column = reinterpret_cast<const vec_t*>(&weights[offset]);
@@ -428,7 +804,7 @@ namespace Stockfish::Eval::NNUE {
             }
 
             // Difference calculation for the activated features
-            for (const auto index : added[i])
+            for (const auto index : added[p][i])
             {
               const IndexType offset = HalfDimensions * index + j * TileHeight;
               auto column = reinterpret_cast<const vec_t*>(&weights[offset]);
@@ -438,24 +814,27 @@ namespace Stockfish::Eval::NNUE {
 
             // Store accumulator
             accTile = reinterpret_cast<vec_t*>(
-              &states_to_update[i]->accumulator.accumulation[perspective][j * TileHeight]);
+              &accumulators_to_update[i]->accumulation[perspective][j * TileHeight]);
             for (IndexType k = 0; k < NumRegs; ++k)
               vec_store(&accTile[k], acc[k]);
           }
         }
 
-        for (IndexType j = 0; j < PSQTBuckets / PsqtTileHeight; ++j)
+      for (IndexType j = 0; j < PSQTBuckets / PsqtTileHeight; ++j)
+        for (int p = 0; p < NumPerspectives; ++p)
         {
+          const Color perspective = perspectives[p];
+
           // Load accumulator
           auto accTilePsqt = reinterpret_cast<psqt_vec_t*>(
-            &st->accumulator.psqtAccumulation[perspective][j * PsqtTileHeight]);
+            &source.psqtAccumulation[perspective][j * PsqtTileHeight]);
           for (std::size_t k = 0; k < NumPsqtRegs; ++k)
             psqt[k] = vec_load_psqt(&accTilePsqt[k]);
 
-          for (IndexType i = 0; states_to_update[i]; ++i)
+          for (IndexType i = 0; accumulators_to_update[i]; ++i)
           {
             // Difference calculation for the deactivated features
-            for (const auto index : removed[i])
+            for (const auto index : removed[p][i])
             {
               const IndexType offset = PSQTBuckets * index + j * PsqtTileHeight;
               auto columnPsqt = reinterpret_cast<const psqt_vec_t*>(&psqtWeights[offset]);
@@ -464,7 +843,7 @@ namespace Stockfish::Eval::NNUE {
             }
 
             // Difference calculation for the activated features
-            for (const auto index : added[i])
+            for (const auto index : added[p][i])
             {
               const IndexType offset = PSQTBuckets * index + j * PsqtTileHeight;
               auto columnPsqt = reinterpret_cast<const psqt_vec_t*>(&psqtWeights[offset]);
@@ -474,131 +853,224 @@ namespace Stockfish::Eval::NNUE {
 
             // Store accumulator
             accTilePsqt = reinterpret_cast<psqt_vec_t*>(
-              &states_to_update[i]->accumulator.psqtAccumulation[perspective][j * PsqtTileHeight]);
+              &accumulators_to_update[i]->psqtAccumulation[perspective][j * PsqtTileHeight]);
             for (std::size_t k = 0; k < NumPsqtRegs; ++k)
               vec_store_psqt(&accTilePsqt[k], psqt[k]);
           }
         }
 
   #else
-        for (IndexType i = 0; states_to_update[i]; ++i)
+      for (int p = 0; p < NumPerspectives; ++p)
+      {
+        const Color perspective = perspectives[p];
+        const Accumulator<Arch>* from = &source;
+
+        for (IndexType i = 0; accumulators_to_update[i]; ++i)
         {
-          std::memcpy(states_to_update[i]->accumulator.accumulation[perspective],
-              st->accumulator.accumulation[perspective],
+          Accumulator<Arch>* to = accumulators_to_update[i];
+
+          std::memcpy(to->accumulation[perspective],
+              from->accumulation[perspective],
               HalfDimensions * sizeof(BiasType));
 
           for (std::size_t k = 0; k < PSQTBuckets; ++k)
-            states_to_update[i]->accumulator.psqtAccumulation[perspective][k] = st->accumulator.psqtAccumulation[perspective][k];
+            to->psqtAccumulation[perspective][k] = from->psqtAccumulation[perspective][k];
 
-          st = states_to_update[i];
+          from = to;
 
           // Difference calculation for the deactivated features
-          for (const auto index : removed[i])
+          for (const auto index : removed[p][i])
           {
             const IndexType offset = HalfDimensions * index;
 
             for (IndexType j = 0; j < HalfDimensions; ++j)
-              st->accumulator.accumulation[perspective][j] -= weights[offset + j];
+              to->accumulation[perspective][j] -= weights[offset + j];
 
             for (std::size_t k = 0; k < PSQTBuckets; ++k)
-              st->accumulator.psqtAccumulation[perspective][k] -= psqtWeights[index * PSQTBuckets + k];
+              to->psqtAccumulation[perspective][k] -= psqtWeights[index * PSQTBuckets + k];
           }
 
           // Difference calculation for the activated features
-          for (const auto index : added[i])
+          for (const auto index : added[p][i])
           {
             const IndexType offset = HalfDimensions * index;
 
             for (IndexType j = 0; j < HalfDimensions; ++j)
-              st->accumulator.accumulation[perspective][j] += weights[offset + j];
+              to->accumulation[perspective][j] += weights[offset + j];
 
             for (std::size_t k = 0; k < PSQTBuckets; ++k)
-              st->accumulator.psqtAccumulation[perspective][k] += psqtWeights[index * PSQTBuckets + k];
+              to->psqtAccumulation[perspective][k] += psqtWeights[index * PSQTBuckets + k];
           }
         }
+      }
   #endif
+
+  #if defined(USE_MMX)
+      _mm_empty();
+  #endif
+    }
+
+    // Refresh the accumulator, starting from the entry of the refresh table
+    // which was last computed by this thread for the same king square.
+    void refresh_accumulator(const Position& pos, const Color perspective) const {
+
+  #ifdef VECTOR
+      vec_t acc[NumRegs];
+      psqt_vec_t psqt[NumPsqtRegs];
+  #endif
+
+      auto& accumulator = pos.accumulators().stack<Arch>()[pos.state()->accumulatorIdx];
+      auto& entry = pos.accumulators().refresh_table<Arch>().entries[pos.square<KING>(perspective)][perspective];
+      accumulator.computed[perspective] = true;
+      IndexList active, removed, added;
+      FeatureSet::append_active_indices(pos, perspective, active);
+      std::sort(active.begin(), active.end());
+
+      if (entry.computed)
+      {
+          // Both lists are sorted, so a single merge pass finds the features
+          // which are only active in the cached position or in the current one.
+          const IndexType *a = entry.active.begin(), *b = active.begin();
+          while (a != entry.active.end() || b != active.end())
+              if (b == active.end() || (a != entry.active.end() && *a < *b))
+                  removed.push_back(*a++);
+              else if (a == entry.active.end() || *b < *a)
+                  added.push_back(*b++);
+              else
+                  ++a, ++b;
       }
-      else
+
+      // Start again from the biases if the entry is empty or if applying the
+      // difference would cost more than a full refresh.
+      if (!entry.computed || removed.size() + added.size() > active.size())
       {
-        // Refresh the accumulator
-        auto& accumulator = pos.state()->accumulator;
-        accumulator.computed[perspective] = true;
-        IndexList active;
-        FeatureSet::append_active_indices(pos, perspective, active);
+          std::memcpy(entry.accumulation, biases, HalfDimensions * sizeof(BiasType));
+          std::memset(entry.psqtAccumulation, 0, PSQTBuckets * sizeof(PSQTWeightType));
+          entry.computed = true;
+          removed.resize(0);
+          added = active;
+      }
+
+      entry.active = active;
 
   #ifdef VECTOR
-        for (IndexType j = 0; j < HalfDimensions / TileHeight; ++j)
+      for (IndexType j = 0; j < HalfDimensions / TileHeight; ++j)
+      {
+        auto entryTile = reinterpret_cast<vec_t*>(
+            &entry.accumulation[j * TileHeight]);
+        for (IndexType k = 0; k < NumRegs; ++k)
+          acc[k] = vec_load(&entryTile[k]);
+
+        for (const auto index : removed)
         {
-          auto biasesTile = reinterpret_cast<const vec_t*>(
-              &biases[j * TileHeight]);
-          for (IndexType k = 0; k < NumRegs; ++k)
-            acc[k] = biasesTile[k];
+          const IndexType offset = HalfDimensions * index + j * TileHeight;
+          auto column = reinterpret_cast<const vec_t*>(&weights[offset]);
 
-          for (const auto index : active)
-          {
-            const IndexType offset = HalfDimensions * index + j * TileHeight;
-            auto column = reinterpret_cast<const vec_t*>(&weights[offset]);
+          for (unsigned k = 0; k < NumRegs; ++k)
+            acc[k] = vec_sub_16(acc[k], column[k]);
+        }
 
-            for (unsigned k = 0; k < NumRegs; ++k)
-              acc[k] = vec_add_16(acc[k], column[k]);
-          }
+        for (const auto index : added)
+        {
+          const IndexType offset = HalfDimensions * index + j * TileHeight;
+          auto column = reinterpret_cast<const vec_t*>(&weights[offset]);
 
-          auto accTile = reinterpret_cast<vec_t*>(
-              &accumulator.accumulation[perspective][j * TileHeight]);
-          for (unsigned k = 0; k < NumRegs; k++)
-            vec_store(&accTile[k], acc[k]);
+          for (unsigned k = 0; k < NumRegs; ++k)
+            acc[k] = vec_add_16(acc[k], column[k]);
         }
 
-        for (IndexType j = 0; j < PSQTBuckets / PsqtTileHeight; ++j)
+        auto accTile = reinterpret_cast<vec_t*>(
+            &accumulator.accumulation[perspective][j * TileHeight]);
+        for (unsigned k = 0; k < NumRegs; k++)
         {
-          for (std::size_t k = 0; k < NumPsqtRegs; ++k)
-            psqt[k] = vec_zero_psqt();
+          vec_store(&entryTile[k], acc[k]);
+          vec_store(&accTile[k], acc[k]);
+        }
+      }
 
-          for (const auto index : active)
-          {
-            const IndexType offset = PSQTBuckets * index + j * PsqtTileHeight;
-            auto columnPsqt = reinterpret_cast<const psqt_vec_t*>(&psqtWeights[offset]);
+      for (IndexType j = 0; j < PSQTBuckets / PsqtTileHeight; ++j)
+      {
+        auto entryTilePsqt = reinterpret_cast<psqt_vec_t*>(
+            &entry.psqtAccumulation[j * PsqtTileHeight]);
+        for (std::size_t k = 0; k < NumPsqtRegs; ++k)
+          psqt[k] = vec_load_psqt(&entryTilePsqt[k]);
 
-            for (std::size_t k = 0; k < NumPsqtRegs; ++k)
-              psqt[k] = vec_add_psqt_32(psqt[k], columnPsqt[k]);
-          }
+        for (const auto index : removed)
+        {
+          const IndexType offset = PSQTBuckets * index + j * PsqtTileHeight;
+          auto columnPsqt = reinterpret_cast<const psqt_vec_t*>(&psqtWeights[offset]);
+
+          for (std::size_t k = 0; k < NumPsqtRegs; ++k)
+            psqt[k] = vec_sub_psqt_32(psqt[k], columnPsqt[k]);
+        }
+
+        for (const auto index : added)
+        {
+          const IndexType offset = PSQTBuckets * index + j * PsqtTileHeight;
+          auto columnPsqt = reinterpret_cast<const psqt_vec_t*>(&psqtWeights[offset]);
 
-          auto accTilePsqt = reinterpret_cast<psqt_vec_t*>(
-            &accumulator.psqtAccumulation[perspective][j * PsqtTileHeight]);
           for (std::size_t k = 0; k < NumPsqtRegs; ++k)
-            vec_store_psqt(&accTilePsqt[k], psqt[k]);
+            psqt[k] = vec_add_psqt_32(psqt[k], columnPsqt[k]);
+        }
+
+        auto accTilePsqt = reinterpret_cast<psqt_vec_t*>(
+          &accumulator.psqtAccumulation[perspective][j * PsqtTileHeight]);
+        for (std::size_t k = 0; k < NumPsqtRegs; ++k)
+        {
+          vec_store_psqt(&entryTilePsqt[k], psqt[k]);
+          vec_store_psqt(&accTilePsqt[k], psqt[k]);
         }
+      }
 
   #else
-        std::memcpy(accumulator.accumulation[perspective], biases,
-            HalfDimensions * sizeof(BiasType));
+      for (const auto index : removed)
+      {
+        const IndexType offset = HalfDimensions * index;
+
+        for (IndexType j = 0; j < HalfDimensions; ++j)
+          entry.accumulation[j] -= weights[offset + j];
 
         for (std::size_t k = 0; k < PSQTBuckets; ++k)
-          accumulator.psqtAccumulation[perspective][k] = 0;
+          entry.psqtAccumulation[k] -= psqtWeights[index * PSQTBuckets + k];
+      }
 
-        for (const auto index : active)
-        {
-          const IndexType offset = HalfDimensions * index;
+      for (const auto index : added)
+      {
+        const IndexType offset = HalfDimensions * index;
 
-          for (IndexType j = 0; j < HalfDimensions; ++j)
-            accumulator.accumulation[perspective][j] += weights[offset + j];
+        for (IndexType j = 0; j < HalfDimensions; ++j)
+          entry.accumulation[j] += weights[offset + j];
 
-          for (std::size_t k = 0; k < PSQTBuckets; ++k)
-            accumulator.psqtAccumulation[perspective][k] += psqtWeights[index * PSQTBuckets + k];
-        }
-  #endif
+        for (std::size_t k = 0; k < PSQTBuckets; ++k)
+          entry.psqtAccumulation[k] += psqtWeights[index * PSQTBuckets + k];
       }
 
+      std::memcpy(accumulator.accumulation[perspective], entry.accumulation,
+          HalfDimensions * sizeof(BiasType));
+      std::memcpy(accumulator.psqtAccumulation[perspective], entry.psqtAccumulation,
+          PSQTBuckets * sizeof(PSQTWeightType));
+  #endif
+
   #if defined(USE_MMX)
       _mm_empty();
   #endif
     }
 
     alignas(CacheLineSize) BiasType biases[HalfDimensions];
-    alignas(CacheLineSize) WeightType weights[HalfDimensions * InputDimensions];
-    alignas(CacheLineSize) PSQTWeightType psqtWeights[InputDimensions * PSQTBuckets];
+
+    // Weights and PSQT weights share a single block, which is either allocated
+    // when reading the net or a read-only mapping of the weight image.
+    WeightType* weights = nullptr;
+    PSQTWeightType* psqtWeights = nullptr;
+
+    // Block holding our weights, and its mapping if any, freed by the destructor
+    void* storage = nullptr;
+    void* image = nullptr;
+    std::uint64_t imageMapping = 0;
   };
 
+  using FeatureTransformer = BasicFeatureTransformer<DefaultArchitecture>;
+
 }  // namespace Stockfish::Eval::NNUE
 
 #endif // #ifndef NNUE_FEATURE_TRANSFORMER_H_INCLUDED
@@ -195,19 +195,24 @@ namespace Pawns {
 /// the pawns hash table. It returns a pointer to the Entry if the position
 /// is found. Otherwise a new Entry is computed and stored there, so we don't
 /// have to recompute all when the same pawns configuration occurs again.
+/// When the table is shared, the Entry is a copy for the thread, see HashTable,
+/// so the king safety computed later is only cached there.
 
 Entry* probe(const Position& pos) {
 
   Key key = pos.pawn_key();
-  Entry* e = pos.this_thread()->pawnsTable[key];
+  TableView& pawns = pos.this_thread()->pawns;
+  bool found;
+  Entry* e = pawns.probe(key, found);
 
-  if (e->key == key)
+  if (found)
       return e;
 
   e->key = key;
   e->blockedCount = 0;
   e->scores[WHITE] = evaluate<WHITE>(pos, e);
   e->scores[BLACK] = evaluate<BLACK>(pos, e);
+  pawns.save(e);
 
   return e;
 }
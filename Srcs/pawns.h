@@ -50,7 +50,8 @@ struct Entry {
   int blockedCount;
 };
 
-typedef HashTable<Entry, 131072> Table;
+typedef HashTable<Entry> Table;
+typedef HashTableView<Entry> TableView;
 
 Entry* probe(const Position& pos);
 
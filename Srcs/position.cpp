@@ -25,22 +25,125 @@ using std::string;
 
 namespace Stockfish {
 
-namespace Zobrist {
+namespace {
 
+const string PieceToChar(" PNBRQK  pnbrqk");
+
+constexpr Piece Pieces[] = { W_PAWN, W_KNIGHT, W_BISHOP, W_ROOK, W_QUEEN, W_KING,
+                             B_PAWN, B_KNIGHT, B_BISHOP, B_ROOK, B_QUEEN, B_KING };
+
+// Marcel van Kervinck's cuckoo algorithm for fast detection of "upcoming repetition"
+// situations. Description of the algorithm in the following paper:
+// https://marcelk.net/2013-04-06/paper/upcoming-rep-v2.pdf
+
+// First and second hash functions for indexing the cuckoo tables
+constexpr int H1(Key h) { return h & 0x1fff; }
+constexpr int H2(Key h) { return (h >> 16) & 0x1fff; }
+
+// The Zobrist keys, and the cuckoo tables with the Zobrist hashes of valid
+// reversible moves and the moves themselves
+struct HashKeys {
   Key psq[PIECE_NB][SQUARE_NB];
   Key enpassant[FILE_NB];
   Key castling[CASTLING_RIGHT_NB];
   Key side, noPawns;
+  Key cuckoo[8192];
+  Move cuckooMove[8192];
+  int cuckooCount;
+};
+
+// pseudo_attacks() returns the attacks of a piece on an empty board. It is
+// attacks_bb() without the tables of Bitboards::init(), for compile time.
+constexpr Bitboard pseudo_attacks(PieceType pt, Square s) {
+
+  constexpr int Steps[][8][2] = {
+    { {-1,-1}, {-1, 0}, {-1, 1}, { 0,-1}, { 0, 1}, { 1,-1}, { 1, 0}, { 1, 1} },  // King and sliders
+    { {-2,-1}, {-2, 1}, {-1,-2}, {-1, 2}, { 1,-2}, { 1, 2}, { 2,-1}, { 2, 1} } }; // Knight
+
+  Bitboard b = 0;
+
+  for (const auto& step : Steps[pt == KNIGHT])
+  {
+      const int df = step[0], dr = step[1];
+      const bool diagonal = df && dr;
+
+      if ((pt == BISHOP && !diagonal) || (pt == ROOK && diagonal))
+          continue;
+
+      for (int f = file_of(s) + df, r = rank_of(s) + dr; f >= 0 && f < 8 && r >= 0 && r < 8; f += df, r += dr)
+      {
+          b |= 1ULL << (8 * r + f);
+
+          if (pt == KNIGHT || pt == KING)
+              break;
+      }
+  }
+
+  return b;
 }
 
-namespace {
+// generate_keys() draws the Zobrist keys and fills the cuckoo tables. It runs
+// at compile time, so that they need no initialization at startup.
+constexpr HashKeys generate_keys() {
 
-const string PieceToChar(" PNBRQK  pnbrqk");
+  HashKeys k = {};
+  PRNG rng(1070372);
+
+  for (Piece pc : Pieces)
+      for (Square s = SQ_A1; s <= SQ_H8; ++s)
+          k.psq[pc][s] = rng.rand<Key>();
+
+  for (File f = FILE_A; f <= FILE_H; ++f)
+      k.enpassant[f] = rng.rand<Key>();
+
+  for (int cr = NO_CASTLING; cr <= ANY_CASTLING; ++cr)
+      k.castling[cr] = rng.rand<Key>();
+
+  k.side = rng.rand<Key>();
+  k.noPawns = rng.rand<Key>();
+
+  // Prepare the cuckoo tables
+  for (Piece pc : Pieces)
+      for (Square s1 = SQ_A1; s1 <= SQ_H8; ++s1)
+          for (Square s2 = Square(s1 + 1); s2 <= SQ_H8; ++s2)
+              if ((type_of(pc) != PAWN) && (pseudo_attacks(type_of(pc), s1) & (1ULL << s2)))
+              {
+                  Move move = make_move(s1, s2);
+                  Key key = k.psq[pc][s1] ^ k.psq[pc][s2] ^ k.side;
+                  int i = H1(key);
+                  while (true)
+                  {
+                      Key k0 = k.cuckoo[i];
+                      Move m0 = k.cuckooMove[i];
+                      k.cuckoo[i] = key, k.cuckooMove[i] = move;
+                      key = k0, move = m0;
+                      if (move == MOVE_NONE) // Arrived at empty slot?
+                          break;
+                      i = (i == H1(key)) ? H2(key) : H1(key); // Push victim to alternative slot
+                  }
+                  k.cuckooCount++;
+              }
+
+  return k;
+}
+
+constexpr HashKeys Keys = generate_keys();
+
+static_assert(Keys.cuckooCount == 3668, "Wrong number of reversible moves in the cuckoo tables");
+
+constexpr const Key (&cuckoo)[8192] = Keys.cuckoo;
+constexpr const Move (&cuckooMove)[8192] = Keys.cuckooMove;
 
-constexpr Piece Pieces[] = { W_PAWN, W_KNIGHT, W_BISHOP, W_ROOK, W_QUEEN, W_KING,
-                             B_PAWN, B_KNIGHT, B_BISHOP, B_ROOK, B_QUEEN, B_KING };
 } // namespace
 
+namespace Zobrist {
+
+  constexpr const Key (&psq)[PIECE_NB][SQUARE_NB] = Keys.psq;
+  constexpr const Key (&enpassant)[FILE_NB] = Keys.enpassant;
+  constexpr const Key (&castling)[CASTLING_RIGHT_NB] = Keys.castling;
+  constexpr Key side = Keys.side, noPawns = Keys.noPawns;
+}
+
 
 /// operator<<(Position) returns an ASCII representation of the position
 
@@ -68,10 +171,9 @@ std::ostream& operator<<(std::ostream& os, const Position& pos) {
       && !pos.can_castle(ANY_CASTLING))
   {
       StateInfo st;
-      ASSERT_ALIGNED(&st, Eval::NNUE::CacheLineSize);
 
       Position p;
-      p.set(pos.fen(), pos.is_chess960(), &st, pos.this_thread());
+      p.set(pos.fen(), pos.is_chess960(), &st, pos.this_thread(), &pos.accumulators());
       Tablebases::ProbeState s1, s2;
       Tablebases::WDLScore wdl = Tablebases::probe_wdl(p, &s1);
       int dtz = Tablebases::probe_dtz(p, &s2);
@@ -83,69 +185,13 @@ std::ostream& operator<<(std::ostream& os, const Position& pos) {
 }
 
 
-// Marcel van Kervinck's cuckoo algorithm for fast detection of "upcoming repetition"
-// situations. Description of the algorithm in the following paper:
-// https://marcelk.net/2013-04-06/paper/upcoming-rep-v2.pdf
-
-// First and second hash functions for indexing the cuckoo tables
-inline int H1(Key h) { return h & 0x1fff; }
-inline int H2(Key h) { return (h >> 16) & 0x1fff; }
-
-// Cuckoo tables with Zobrist hashes of valid reversible moves, and the moves themselves
-Key cuckoo[8192];
-Move cuckooMove[8192];
-
-
-/// Position::init() initializes at startup the various arrays used to compute hash keys
-
-void Position::init() {
-
-  PRNG rng(1070372);
-
-  for (Piece pc : Pieces)
-      for (Square s = SQ_A1; s <= SQ_H8; ++s)
-          Zobrist::psq[pc][s] = rng.rand<Key>();
-
-  for (File f = FILE_A; f <= FILE_H; ++f)
-      Zobrist::enpassant[f] = rng.rand<Key>();
-
-  for (int cr = NO_CASTLING; cr <= ANY_CASTLING; ++cr)
-      Zobrist::castling[cr] = rng.rand<Key>();
-
-  Zobrist::side = rng.rand<Key>();
-  Zobrist::noPawns = rng.rand<Key>();
-
-  // Prepare the cuckoo tables
-  std::memset(cuckoo, 0, sizeof(cuckoo));
-  std::memset(cuckooMove, 0, sizeof(cuckooMove));
-  int count = 0;
-  for (Piece pc : Pieces)
-      for (Square s1 = SQ_A1; s1 <= SQ_H8; ++s1)
-          for (Square s2 = Square(s1 + 1); s2 <= SQ_H8; ++s2)
-              if ((type_of(pc) != PAWN) && (attacks_bb(type_of(pc), s1, 0) & s2))
-              {
-                  Move move = make_move(s1, s2);
-                  Key key = Zobrist::psq[pc][s1] ^ Zobrist::psq[pc][s2] ^ Zobrist::side;
-                  int i = H1(key);
-                  while (true)
-                  {
-                      std::swap(cuckoo[i], key);
-                      std::swap(cuckooMove[i], move);
-                      if (move == MOVE_NONE) // Arrived at empty slot?
-                          break;
-                      i = (i == H1(key)) ? H2(key) : H1(key); // Push victim to alternative slot
-                  }
-                  count++;
-             }
-  assert(count == 3668);
-}
-
-
 /// Position::set() initializes the position object with the given FEN string.
 /// This function is not very robust - make sure that input FENs are correct,
-/// this is assumed to be the responsibility of the GUI.
+/// this is assumed to be the responsibility of the GUI. The NNUE accumulators
+/// are claimed in 'acc', by default in those of the thread.
 
-Position& Position::set(const string& fenStr, bool isChess960, StateInfo* si, Thread* th) {
+Position& Position::set(const string& fenStr, bool isChess960, StateInfo* si, Thread* th,
+                        Eval::NNUE::ThreadAccumulators* acc) {
 /*
    A FEN string defines a particular position using only the ASCII character set.
 
@@ -270,8 +316,20 @@ Position& Position::set(const string& fenStr, bool isChess960, StateInfo* si, Th
 
   chess960 = isChess960;
   thisThread = th;
+  nnueAccumulators = acc ? acc : th ? &th->accumulators : nullptr;
   set_state(st);
 
+  for (Bitboard b = pieces(BISHOP, ROOK) | pieces(QUEEN); b; )
+  {
+      Square s = pop_lsb(b);
+      sliderAttacks[s] = attacks_bb(type_of(piece_on(s)), s, pieces());
+  }
+
+  attacksState = st;
+
+  if (nnueAccumulators)
+      nnueAccumulators->claim(st->accumulatorIdx, st);
+
   assert(pos_is_ok());
 
   return *this;
@@ -681,6 +739,7 @@ void Position::do_move(Move m, StateInfo& newSt, bool givesCheck) {
   // ones which are going to be recalculated from scratch anyway and then switch
   // our state pointer to point to the new (ready to be updated) state.
   std::memcpy(&newSt, st, offsetof(StateInfo, key));
+  newSt.accumulatorIdx = st->accumulatorIdx + 1;
   newSt.previous = st;
   st = &newSt;
 
@@ -691,8 +750,7 @@ void Position::do_move(Move m, StateInfo& newSt, bool givesCheck) {
   ++st->pliesFromNull;
 
   // Used by NNUE
-  st->accumulator.computed[WHITE] = false;
-  st->accumulator.computed[BLACK] = false;
+  nnueAccumulators->claim(st->accumulatorIdx, st);
   auto& dp = st->dirtyPiece;
   dp.dirty_num = 1;
 
@@ -702,6 +760,7 @@ void Position::do_move(Move m, StateInfo& newSt, bool givesCheck) {
   Square to = to_sq(m);
   Piece pc = piece_on(from);
   Piece captured = type_of(m) == EN_PASSANT ? make_piece(them, PAWN) : piece_on(to);
+  Bitboard changed = from | to; // Squares whose piece changes
 
   assert(color_of(pc) == us);
   assert(captured == NO_PIECE || color_of(captured) == (type_of(m) != CASTLING ? them : us));
@@ -714,6 +773,7 @@ void Position::do_move(Move m, StateInfo& newSt, bool givesCheck) {
 
       Square rfrom, rto;
       do_castling<true>(us, from, to, rfrom, rto);
+      changed |= to | rto;
 
       k ^= Zobrist::psq[captured][rfrom] ^ Zobrist::psq[captured][rto];
       captured = NO_PIECE;
@@ -753,6 +813,7 @@ void Position::do_move(Move m, StateInfo& newSt, bool givesCheck) {
 
       // Update board and piece lists
       remove_piece(capsq);
+      changed |= capsq;
 
       if (type_of(m) == EN_PASSANT)
           board[capsq] = NO_PIECE;
@@ -760,7 +821,7 @@ void Position::do_move(Move m, StateInfo& newSt, bool givesCheck) {
       // Update material hash key and prefetch access to materialTable
       k ^= Zobrist::psq[captured][capsq];
       st->materialKey ^= Zobrist::psq[captured][pieceCount[captured]];
-      prefetch(thisThread->materialTable[st->materialKey]);
+      prefetch(thisThread->material.table->address(st->materialKey));
 
       // Reset rule 50 counter
       st->rule50 = 0;
@@ -845,12 +906,18 @@ void Position::do_move(Move m, StateInfo& newSt, bool givesCheck) {
       st->rule50 = 0;
   }
 
+  // Start loading the NNUE weights needed to update the accumulator
+  if (Eval::useNNUE && Eval::NNUE::prefetchWeights)
+      Eval::NNUE::prefetch_weights(*this);
+
   // Set capture piece
   st->capturedPiece = captured;
 
   // Update the key with the final value
   st->key = k;
 
+  st->changedSquares = changed;
+
   // Calculate checkers bitboard (if move gives check)
   st->checkersBB = givesCheck ? attackers_to(square<KING>(them)) & pieces(us) : 0;
 
@@ -938,6 +1005,8 @@ void Position::undo_move(Move m) {
       }
   }
 
+  restore_attacks();
+
   // Finally point our state pointer back to the previous state
   st = st->previous;
   --gamePly;
@@ -946,6 +1015,57 @@ void Position::undo_move(Move m) {
 }
 
 
+/// Position::update_attacks() brings the attacks of the sliders up to date
+/// with the current state, from the state they were last updated with, saving
+/// the attacks it overwrites for undo_move(). Only the sliders on the squares
+/// whose piece changed since then, and those whose rays reach these squares,
+/// can have new attacks: a ray that is opened or closed on a square attacked
+/// it before. The update is done on demand, so that the nodes which are left
+/// before evaluating the position don't pay for it.
+
+void Position::update_attacks() const {
+
+  Bitboard changed = 0;
+  for (StateInfo* si = st; si != attacksState; si = si->previous)
+      changed |= si->changedSquares;
+
+  int n = 0;
+
+  for (Bitboard b = pieces(BISHOP, ROOK) | pieces(QUEEN); b; )
+  {
+      Square s = pop_lsb(b);
+      if ((changed & s) || (sliderAttacks[s] & changed))
+      {
+          assert(n < StateInfo::MaxSliders);
+
+          st->savedSquares[n] = std::uint8_t(s);
+          st->savedAttacks[n++] = sliderAttacks[s];
+          sliderAttacks[s] = attacks_bb(type_of(piece_on(s)), s, pieces());
+      }
+  }
+
+  st->savedAttacksCount = n;
+  st->attacksPrevious = attacksState;
+  attacksState = st;
+}
+
+
+/// Position::restore_attacks() is called when leaving the current state. If
+/// the attack table was updated with it, the table goes back to the state it
+/// was updated from.
+
+void Position::restore_attacks() {
+
+  if (attacksState != st)
+      return;
+
+  for (int i = 0; i < st->savedAttacksCount; ++i)
+      sliderAttacks[Square(st->savedSquares[i])] = st->savedAttacks[i];
+
+  attacksState = st->attacksPrevious;
+}
+
+
 /// Position::do_castling() is a helper used to do/undo a castling move. This
 /// is a bit tricky in Chess960 where from/to squares can overlap.
 template<bool Do>
@@ -985,15 +1105,16 @@ void Position::do_null_move(StateInfo& newSt) {
   assert(!checkers());
   assert(&newSt != st);
 
-  std::memcpy(&newSt, st, offsetof(StateInfo, accumulator));
+  std::memcpy(&newSt, st, offsetof(StateInfo, accumulatorIdx));
 
+  newSt.accumulatorIdx = st->accumulatorIdx + 1;
   newSt.previous = st;
   st = &newSt;
 
   st->dirtyPiece.dirty_num = 0;
   st->dirtyPiece.piece[0] = NO_PIECE; // Avoid checks in UpdateAccumulator()
-  st->accumulator.computed[WHITE] = false;
-  st->accumulator.computed[BLACK] = false;
+  st->changedSquares = 0;
+  nnueAccumulators->claim(st->accumulatorIdx, st);
 
   if (st->epSquare != SQ_NONE)
   {
@@ -1023,6 +1144,7 @@ void Position::undo_null_move() {
 
   assert(!checkers());
 
+  restore_attacks();
   st = st->previous;
   sideToMove = ~sideToMove;
 }
@@ -1262,7 +1384,7 @@ void Position::flip() {
   std::getline(ss, token); // Half and full moves
   f += token;
 
-  set(f, is_chess960(), st, this_thread());
+  set(f, is_chess960(), st, this_thread(), nnueAccumulators);
 
   assert(pos_is_ok());
 }
@@ -1308,12 +1430,19 @@ bool Position::pos_is_ok() const {
               assert(0 && "pos_is_ok: Bitboards");
 
   StateInfo si = *st;
-  ASSERT_ALIGNED(&si, Eval::NNUE::CacheLineSize);
 
   set_state(&si);
   if (std::memcmp(&si, st, sizeof(StateInfo)))
       assert(0 && "pos_is_ok: State");
 
+  if (attacksState == st)
+      for (Bitboard b = pieces(BISHOP, ROOK) | pieces(QUEEN); b; )
+      {
+          Square s = pop_lsb(b);
+          if (sliderAttacks[s] != attacks_bb(type_of(piece_on(s)), s, pieces()))
+              assert(0 && "pos_is_ok: Attacks");
+      }
+
   for (Piece pc : Pieces)
       if (   pieceCount[pc] != popcount(pieces(color_of(pc), type_of(pc)))
           || pieceCount[pc] != std::count(board, board + SQUARE_NB, pc))
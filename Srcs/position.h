@@ -47,9 +47,21 @@ struct StateInfo {
   Piece      capturedPiece;
   int        repetition;
 
-  // Used by NNUE
-  Eval::NNUE::Accumulator accumulator;
+  // Used by NNUE, the accumulator is in the AccumulatorStack of the thread
+  int        accumulatorIdx;
   DirtyPiece dirtyPiece;
+
+  // Squares whose piece changed with the move, and the slider attacks which
+  // were overwritten when the attack table of the position was brought up to
+  // date with this state, from attacksPrevious. Restored by undo_move(). With
+  // at most 16 pieces per side, kings included, there are at most 30 sliders.
+  static constexpr int MaxSliders = 30;
+
+  Bitboard     changedSquares;
+  StateInfo*   attacksPrevious;
+  int          savedAttacksCount;
+  std::uint8_t savedSquares[MaxSliders];
+  Bitboard     savedAttacks[MaxSliders];
 };
 
 
@@ -68,14 +80,13 @@ class Thread;
 
 class Position {
 public:
-  static void init();
-
   Position() = default;
   Position(const Position&) = delete;
   Position& operator=(const Position&) = delete;
 
   // FEN string input/output
-  Position& set(const std::string& fenStr, bool isChess960, StateInfo* si, Thread* th);
+  Position& set(const std::string& fenStr, bool isChess960, StateInfo* si, Thread* th,
+                Eval::NNUE::ThreadAccumulators* acc = nullptr);
   Position& set(const std::string& code, Color c, StateInfo* si);
   std::string fen() const;
 
@@ -108,6 +119,7 @@ public:
   // Attacks to/from a given square
   Bitboard attackers_to(Square s) const;
   Bitboard attackers_to(Square s, Bitboard occupied) const;
+  template<PieceType Pt> Bitboard attacks_from(Square s) const;
   Bitboard slider_blockers(Bitboard sliders, Square s, Bitboard& pinners) const;
 
   // Properties of moves
@@ -145,6 +157,7 @@ public:
   int game_ply() const;
   bool is_chess960() const;
   Thread* this_thread() const;
+  Eval::NNUE::ThreadAccumulators& accumulators() const;
   bool is_draw(int ply) const;
   bool has_game_cycle(int ply) const;
   bool has_repeated() const;
@@ -171,6 +184,8 @@ private:
 
   // Other helpers
   void move_piece(Square from, Square to);
+  void update_attacks() const;
+  void restore_attacks();
   template<bool Do>
   void do_castling(Color us, Square from, Square& to, Square& rfrom, Square& rto);
 
@@ -183,7 +198,10 @@ private:
   Square castlingRookSquare[CASTLING_RIGHT_NB];
   Bitboard castlingPath[CASTLING_RIGHT_NB];
   Thread* thisThread;
+  Eval::NNUE::ThreadAccumulators* nnueAccumulators;
   StateInfo* st;
+  mutable Bitboard sliderAttacks[SQUARE_NB];
+  mutable StateInfo* attacksState;
   int gamePly;
   Color sideToMove;
   Score psq;
@@ -274,6 +292,21 @@ inline Bitboard Position::attackers_to(Square s) const {
   return attackers_to(s, pieces());
 }
 
+template<PieceType Pt>
+inline Bitboard Position::attacks_from(Square s) const {
+
+  static_assert(Pt != PAWN, "Pawn attacks depend on the color");
+  assert(type_of(piece_on(s)) == Pt);
+
+  if (Pt == KNIGHT || Pt == KING)
+      return attacks_bb<Pt>(s);
+
+  if (attacksState != st)
+      update_attacks();
+
+  return sliderAttacks[s];
+}
+
 inline Bitboard Position::checkers() const {
   return st->checkersBB;
 }
@@ -360,6 +393,10 @@ inline Thread* Position::this_thread() const {
   return thisThread;
 }
 
+inline Eval::NNUE::ThreadAccumulators& Position::accumulators() const {
+  return *nnueAccumulators;
+}
+
 inline void Position::put_piece(Piece pc, Square s) {
 
   board[s] = pc;
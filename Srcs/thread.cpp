@@ -50,6 +50,9 @@ void Thread::clear() {
   mainHistory.fill(0);
   lowPlyHistory.fill(0);
   captureHistory.fill(0);
+  accumulators.clear();
+  evalCache.resize(size_t(Options["Eval Cache"]));
+  pawns.hits = pawns.probes = material.hits = material.probes = 0;
 
   for (bool inCheck : { false, true })
       for (StatsType c : { NoCaptures, Captures })
@@ -72,6 +75,22 @@ void Thread::start_searching() {
 }
 
 
+/// Thread::run_custom_job() wakes up the thread to run f() instead of a search,
+/// and returns immediately. wait_for_search_finished() waits for the end of the
+/// job. A thread bound to a NUMA node so touches first the memory of f() there.
+
+void Thread::run_custom_job(std::function<void()> f) {
+
+  {
+      std::unique_lock<std::mutex> lk(mutex);
+      cv.wait(lk, [&]{ return !searching; });
+      jobFunc = std::move(f);
+      searching = true;
+  }
+  cv.notify_one(); // Wake up the thread in idle_loop()
+}
+
+
 /// Thread::wait_for_search_finished() blocks on the condition variable
 /// until the thread has finished searching.
 
@@ -105,9 +124,15 @@ void Thread::idle_loop() {
       if (exit)
           return;
 
+      std::function<void()> job = std::move(jobFunc);
+      jobFunc = nullptr;
+
       lk.unlock();
 
-      search();
+      if (job)
+          job();
+      else
+          search();
   }
 }
 
@@ -131,8 +156,12 @@ void ThreadPool::set(size_t requested) {
 
       while (size() < requested)
           push_back(new Thread(size()));
+      resize_eval_tables();
       clear();
 
+      // Give the new threads the nets of their NUMA node
+      Eval::NNUE::replicate();
+
       // Reallocate the hash with the new threadpool size
       TT.resize(size_t(Options["Hash"]));
 
@@ -142,13 +171,48 @@ void ThreadPool::set(size_t requested) {
 }
 
 
+/// ThreadPool::resize_eval_tables() allocates the pawn and material tables
+/// after the "Pawn Hash" option, the material table getting 1/32 of the size.
+/// With the "Shared Pawn Hash" option all the threads use a single pair of
+/// tables, so that the entries computed by one of them serve the others,
+/// otherwise each thread has its own.
+
+void ThreadPool::resize_eval_tables() {
+
+  static Pawns::Table sharedPawnsTable;
+  static Material::Table sharedMaterialTable;
+
+  const size_t bytes = size_t(Options["Pawn Hash"]) * 1024 * 1024;
+  const bool shared = Options["Shared Pawn Hash"];
+
+  sharedPawnsTable.resize(shared ? bytes : 0);
+  sharedMaterialTable.resize(shared ? bytes / 32 : 0);
+
+  for (Thread* th : *this)
+  {
+      th->pawnsTable.resize(shared ? 0 : bytes);
+      th->materialTable.resize(shared ? 0 : bytes / 32);
+      th->pawns.table = shared ? &sharedPawnsTable : &th->pawnsTable;
+      th->material.table = shared ? &sharedMaterialTable : &th->materialTable;
+      th->pawns.shared = th->material.shared = shared;
+  }
+}
+
+
 /// ThreadPool::clear() sets threadPool data to initial values
 
 void ThreadPool::clear() {
 
+  // Each thread clears its own data, bound as in Thread::idle_loop(). On systems
+  // with a first-touch policy its histories are then allocated on the NUMA node
+  // it runs on, when cleared for the first time.
+  for (Thread* th : *this)
+      th->run_custom_job([th]() { th->clear(); });
+
   for (Thread* th : *this)
-      th->clear();
+      th->wait_for_search_finished();
 
+  uciAccumulators.clear();
   main()->callsCnt = 0;
   main()->bestPreviousScore = VALUE_INFINITE;
   main()->previousTimeReduction = 1.0;
@@ -196,6 +260,7 @@ void ThreadPool::start_thinking(Position& pos, StateListPtr& states,
       th->rootMoves = rootMoves;
       th->rootPos.set(pos.fen(), pos.is_chess960(), &th->rootState, th);
       th->rootState = setupStates->back();
+      th->rootState.accumulatorIdx = 0; // Keep the accumulator claimed by set()
   }
 
   main()->start_searching();
@@ -10,6 +10,7 @@
 
 #include <atomic>
 #include <condition_variable>
+#include <functional>
 #include <mutex>
 #include <thread>
 #include <vector>
@@ -34,6 +35,7 @@ class Thread {
   std::condition_variable cv;
   size_t idx;
   bool exit = false, searching = true; // Set before starting std::thread
+  std::function<void()> jobFunc;       // Run by idle_loop() instead of search()
   NativeThread stdThread;
 
 public:
@@ -43,11 +45,17 @@ public:
   void clear();
   void idle_loop();
   void start_searching();
+  void run_custom_job(std::function<void()> f);
   void wait_for_search_finished();
   size_t id() const { return idx; }
 
-  Pawns::Table pawnsTable;
+  Pawns::Table pawnsTable;           // Our own tables, unused when they are shared
   Material::Table materialTable;
+  Pawns::TableView pawns;            // The tables we probe, see resize_eval_tables()
+  Material::TableView material;
+  Eval::NNUE::ThreadAccumulators accumulators;
+  const Eval::NNUE::Net* net = nullptr; // The net loaded, or its copy in the memory of our NUMA node
+  Eval::EvalCache evalCache;
   size_t pvIdx, pvLast;
   uint64_t ttHitAverage;
   int selDepth, nmpMinPly;
@@ -94,6 +102,7 @@ struct ThreadPool : public std::vector<Thread*> {
   void start_thinking(Position&, StateListPtr&, const Search::LimitsType&, bool = false);
   void clear();
   void set(size_t);
+  void resize_eval_tables();
 
   MainThread* main()        const { return static_cast<MainThread*>(front()); }
   uint64_t nodes_searched() const { return accumulate(&Thread::nodes); }
@@ -103,6 +112,7 @@ struct ThreadPool : public std::vector<Thread*> {
   void wait_for_search_finished() const;
 
   std::atomic_bool stop, increaseDepth;
+  Eval::NNUE::ThreadAccumulators uciAccumulators; // Of the positions of the UCI thread
 
 private:
   StateListPtr setupStates;
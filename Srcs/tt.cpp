@@ -5,9 +5,25 @@
   License - GPL-3.0
 */
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstring>   // For std::memset
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <limits>
+#include <mutex>
 #include <thread>
+#include <unordered_map>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>  // For __rdtsc()
+#define HAS_RDTSC
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define HAS_RDTSC
+#endif
 
 #include "bitboard.h"
 #include "misc.h"
@@ -19,45 +35,201 @@ namespace Stockfish {
 
 TranspositionTable TT; // Our global transposition table
 
+namespace {
+
+#ifdef USE_TTBENCH
+  // Time stamp counter, for the cycles per probe of ttbench. Where there is
+  // none, the nanoseconds of the steady clock are used instead.
+  uint64_t cycles() {
+#if defined(HAS_RDTSC)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+           std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+  }
+#endif
+
+  // Whether a * b < c * d, comparing the full 128-bit products
+  bool product_less(uint64_t a, uint64_t b, uint64_t c, uint64_t d) {
+    const uint64_t hi1 = mul_hi64(a, b), hi2 = mul_hi64(c, d);
+    return hi1 < hi2 || (hi1 == hi2 && a * b < c * d);
+  }
+
+  // floor(a * b / c), for a result that fits in 64 bits. The estimate in double
+  // precision is off by at most one for the cluster counts of the table.
+  uint64_t mul_div(uint64_t a, uint64_t b, uint64_t c) {
+    uint64_t q = uint64_t(double(a) * double(b) / double(c));
+    while (q > 0 && product_less(a, b, q, c))
+        --q;
+    while (!product_less(a, b, q + 1, c))
+        ++q;
+    return q;
+  }
+}
+
+#ifdef USE_TTBENCH
+
+/// TranspositionTable::Trace records the accesses to the table during a search,
+/// for ttbench to replay them. A save refers to the probe that returned its
+/// entry, so that the replay writes to the entry probed for it. It is compiled
+/// in only with ttbench=yes, so that the probes and saves of the other builds
+/// have no check for it.
+
+struct TranspositionTable::Trace {
+
+  enum Type : uint8_t { PROBE, SAVE, NEW_SEARCH };
+
+  struct Op {
+    Key      key;
+    uint32_t probe;
+    int16_t  value, eval, depth;
+    uint16_t move;
+    uint8_t  pvBound, type;
+  };
+
+  void probe(Key key, const TTEntry* tte) {
+    std::lock_guard<std::mutex> lock(mutex);
+    lastProbe[tte] = probes++;
+    ops.push_back({ key, 0, 0, 0, 0, 0, 0, PROBE });
+  }
+
+  std::vector<Op> ops;
+  std::unordered_map<const TTEntry*, uint32_t> lastProbe;
+  uint32_t probes = 0, saves = 0;
+  std::mutex mutex;
+};
+
+#endif
+
 /// TTEntry::save() populates the TTEntry with a new node's data, possibly
-/// overwriting an old position. Update is not atomic and can be racy.
+/// overwriting an old position. Update is not atomic and can be racy, but the
+/// key is written last and encoded with the data, so a torn entry is rejected
+/// by the next probe.
 
 void TTEntry::save(Key k, Value v, bool pv, Bound b, Depth d, Move m, Value ev) {
 
+#ifdef USE_TTBENCH
+  if (TT.trace)
+      TT.record_save(this, k, v, pv, b, d, m, ev);
+#endif
+
+  uint16_t k16 = key();
+
   // Preserve any existing move for the same position
-  if (m || (uint16_t)k != key16)
+  if (m || (uint16_t)k != k16)
       move16 = (uint16_t)m;
 
   // Overwrite less valuable entries (cheapest checks first)
   if (b == BOUND_EXACT
-      || (uint16_t)k != key16
+      || (uint16_t)k != k16
       || d - DEPTH_OFFSET > depth8 - 4)
   {
       assert(d > DEPTH_OFFSET);
       assert(d < 256 + DEPTH_OFFSET);
 
-      key16     = (uint16_t)k;
+      k16       = (uint16_t)k;
       depth8    = (uint8_t)(d - DEPTH_OFFSET);
       genBound8 = (uint8_t)(TT.generation8 | uint8_t(pv) << 2 | b);
       value16   = (int16_t)v;
       eval16    = (int16_t)ev;
   }
+
+  set_key(k16);
+}
+
+
+/// TranspositionTable::new_search() starts a new generation of the entries,
+/// which is also written to the header of the "Hash File".
+
+void TranspositionTable::new_search() {
+
+  generation8 += GENERATION_DELTA; // Lower bits are used for other things
+
+  if (header)
+      header->generation8 = generation8;
+
+#ifdef USE_TTBENCH
+  if (trace)
+      record_new_search();
+#endif
 }
 
 
 /// TranspositionTable::resize() sets the size of the transposition table,
-/// measured in megabytes. Transposition table consists of a power of 2 number
-/// of clusters and each cluster consists of ClusterSize number of TTEntry.
+/// measured in megabytes, with clusters of the current layout. When the
+/// "Hash File" option is set the table is mapped from that file, and if the
+/// file holds a table of the same size and layout its entries are kept. With
+/// the "Preserve Hash" option the entries of a table in memory are moved to
+/// the new one, see migrate(), and the table is kept as it is if its shape does
+/// not change. Both tables are then in memory at once, and if there is not
+/// enough for that the entries are dropped.
 
 void TranspositionTable::resize(size_t mbSize) {
 
   Threads.main()->wait_for_search_finished();
 
-  aligned_large_pages_free(table);
+  const std::string fileName = Options["Hash File"];
+  const bool mapFile = !fileName.empty() && fileName != "<empty>";
+  const bool preserve = Options["Preserve Hash"] && table && !header && !mapFile;
 
-  clusterCount = mbSize * 1024 * 1024 / sizeof(Cluster);
+  const size_t oldCount = clusterCount, oldBytes = clusterBytes;
+  const int oldEntries = entryCount;
+
+  set_shape(mbSize);
+
+  // Cluster32 and TwoLevel entries are at the same places
+  if (preserve && clusterCount == oldCount && clusterBytes == oldBytes)
+  {
+      place();
+      return;
+  }
+
+  void* oldTable = nullptr;
+
+  if (preserve)
+      oldTable = table, table = nullptr;
+  else
+      release();
+
+  if (mapFile)
+  {
+      void* baseAddress = map_file_rw(fileName, HeaderBytes + clusterCount * clusterBytes, &mapping);
+
+      if (baseAddress)
+      {
+          header = static_cast<FileHeader*>(baseAddress);
+          table  = static_cast<char*>(baseAddress) + HeaderBytes;
+
+          if (   header->magic        == FileMagic
+              && header->layout       == uint32_t(layout)
+              && header->clusterCount == clusterCount
+              && header->clusterBytes == clusterBytes)
+          {
+              generation8 = uint8_t(header->generation8);
+              sync_cout << "info string Hash entries of " << fileName << " kept" << sync_endl;
+              return;
+          }
+
+          *header = { FileMagic, uint32_t(layout), generation8, clusterCount, clusterBytes };
+          clear();
+          return;
+      }
+
+      sync_cout << "info string Cannot map " << fileName << ", the hash is kept in memory" << sync_endl;
+  }
+
+  table = aligned_large_pages_alloc(clusterCount * clusterBytes);
+
+  // Without the memory for both tables, drop the entries rather than the engine
+  if (!table && oldTable)
+  {
+      aligned_large_pages_free(oldTable);
+      oldTable = nullptr;
+      sync_cout << "info string Not enough memory to preserve the hash, its entries are dropped" << sync_endl;
+      table = aligned_large_pages_alloc(clusterCount * clusterBytes);
+  }
 
-  table = static_cast<Cluster*>(aligned_large_pages_alloc(clusterCount * sizeof(Cluster)));
   if (!table)
   {
       std::cerr << "Failed to allocate " << mbSize
@@ -65,32 +237,175 @@ void TranspositionTable::resize(size_t mbSize) {
       exit(EXIT_FAILURE);
   }
 
-  clear();
+  place();
+
+  if (oldTable)
+  {
+      migrate(oldTable, oldCount, oldBytes, oldEntries);
+      aligned_large_pages_free(oldTable);
+  }
+  else
+      clear();
 }
 
 
-/// TranspositionTable::clear() initializes the entire transposition table to zero,
-//  in a multi-threaded way.
+/// TranspositionTable::set_shape() sets the size and the number of entries of
+/// the clusters of the current layout, and the number of clusters of a table
+/// of mbSize megabytes.
 
-void TranspositionTable::clear() {
+void TranspositionTable::set_shape(size_t mbSize) {
+
+  clusterBytes = layout == BUCKET_64 ? sizeof(Bucket64) : layout == TWO_LEVEL ? sizeof(TwoLevel) : sizeof(Cluster32);
+  entryCount   = layout == BUCKET_64 ? Bucket64::EntryCount : layout == TWO_LEVEL ? TwoLevel::EntryCount : Cluster32::EntryCount;
+  clusterCount = mbSize * 1024 * 1024 / clusterBytes;
+}
+
+
+/// TranspositionTable::migrate() fills the table, in a multi-threaded way, with
+/// the entries of a table of another size or layout. A position is in cluster
+/// mul_hi64(key, clusterCount), the one whose share of the key range holds its
+/// key, so a cluster takes the entries of the old clusters whose share overlaps
+/// its own. After a shrink these are whole old clusters. After a growth the key
+/// of an entry is not known, so it is copied to the clusters it may belong to,
+/// and the copies which are never probed age out. To bound the writes and the
+/// fill of the new table, the copies go to at most MaxCopies of them, evenly
+/// spaced: past a 4x growth only a share of the entries can be found again. The
+/// entries of each cluster are stored oldest generation first, so that with the
+/// replacement strategy of probe() the recent entries win the slots.
+
+void TranspositionTable::migrate(const void* from, size_t count, size_t bytes, int entries) {
+
+  constexpr uint64_t MaxCopies = 4;
+
+  for_each_slice([&](size_t start, size_t len) {
+
+      std::vector<TTEntry> moved;
+
+      std::memset(cluster(start), 0, len * clusterBytes);
+
+      for (size_t j = start; j < start + len; ++j)
+      {
+          // The old clusters i with i / count < (j + 1) / clusterCount and
+          // j / clusterCount < (i + 1) / count.
+          const uint64_t first = mul_div(j, count, clusterCount);
+          uint64_t last = mul_div(j + 1, count, clusterCount);
+
+          if (!product_less(last, clusterCount, j + 1, count))
+              --last;
+
+          moved.clear();
+
+          for (uint64_t i = first; i <= last; ++i)
+          {
+              // The new clusters lo to hi the old cluster i overlaps, of which
+              // those at lo + t * n / MaxCopies for t < MaxCopies get a copy.
+              if (clusterCount > count)
+              {
+                  const uint64_t lo = mul_div(i, clusterCount, count);
+                  uint64_t hi = mul_div(i + 1, clusterCount, count);
+
+                  if (!product_less(hi, count, i + 1, clusterCount))
+                      --hi;
+
+                  const uint64_t n = hi - lo + 1;
+                  const uint64_t t = ((j - lo) * MaxCopies + n - 1) / n;
+
+                  if (n > MaxCopies && (t >= MaxCopies || lo + t * n / MaxCopies != j))
+                      continue;
+              }
+
+              const TTEntry* tte = reinterpret_cast<const TTEntry*>(static_cast<const char*>(from) + i * bytes);
+
+              for (int k = 0; k < entries; ++k)
+                  if (tte[k].depth8)
+                      moved.push_back(tte[k]);
+          }
+
+          std::stable_sort(moved.begin(), moved.end(), [&](const TTEntry& a, const TTEntry& b) {
+              return  ((GENERATION_CYCLE + generation8 - a.genBound8) & GENERATION_MASK)
+                    > ((GENERATION_CYCLE + generation8 - b.genBound8) & GENERATION_MASK);
+          });
+
+          TTEntry* const tte = cluster(j);
+
+          for (const TTEntry& e : moved)
+          {
+              TTEntry* replace = tte;
+              for (int k = 1; k < entryCount && replace->depth8; ++k)
+                  if (!tte[k].depth8 || replace_value(*replace) > replace_value(tte[k]))
+                      replace = &tte[k];
+
+              if (!replace->depth8 || replace_value(e) >= replace_value(*replace))
+                  *replace = e;
+          }
+      }
+  });
+}
+
+
+/// TranspositionTable::place() puts the pages of the table in memory on the
+/// NUMA nodes after the "Hash Placement" option: "Interleave" spreads them
+/// evenly over the nodes, and "Slices" puts the slice of each thread of
+/// clear() on the node of the thread, or on another one when it is full. With
+/// "Default" the pages are where the first touch puts them, that is where the
+/// bound threads of clear() run.
+
+void TranspositionTable::place() {
+
+  if (Options["Hash Placement"] == "Interleave")
+      WinProcGroup::interleave(table, clusterCount * clusterBytes);
+
+  else if (Options["Hash Placement"] == "Slices")
+  {
+      const size_t threads = Options["Threads"], stride = clusterCount / threads;
+
+      for (size_t idx = 0; idx < threads; ++idx)
+      {
+          const size_t start = stride * idx,
+                       len   = idx != threads - 1 ? stride : clusterCount - start;
+
+          WinProcGroup::prefer_node(cluster(start), len * clusterBytes, WinProcGroup::best_node(idx));
+      }
+  }
+}
+
+
+/// TranspositionTable::release() frees the table, or unmaps it from its file
+
+void TranspositionTable::release() {
+
+  if (header)
+      unmap_file(header, mapping);
+  else
+      aligned_large_pages_free(table);
+
+  header = nullptr;
+  table = nullptr;
+}
+
+
+/// TranspositionTable::for_each_slice() splits the clusters in one slice per
+/// search thread, and calls f(start, len) for each slice in its own thread.
+
+template<typename F>
+void TranspositionTable::for_each_slice(const F& f) const {
 
   std::vector<std::thread> threads;
 
   for (size_t idx = 0; idx < Options["Threads"]; ++idx)
   {
-      threads.emplace_back([this, idx]() {
+      threads.emplace_back([this, &f, idx]() {
 
           // Thread binding gives faster search on systems with a first-touch policy
           if (Options["Threads"] > 8)
               WinProcGroup::bindThisThread(idx);
 
-          // Each thread will zero its part of the hash table
           const size_t stride = size_t(clusterCount / Options["Threads"]),
                        start  = size_t(stride * idx),
                        len    = idx != Options["Threads"] - 1 ?
                                 stride : clusterCount - start;
 
-          std::memset(&table[start], 0, len * sizeof(Cluster));
+          f(start, len);
       });
   }
 
@@ -99,38 +414,156 @@ void TranspositionTable::clear() {
 }
 
 
+/// TranspositionTable::clear() initializes the entire transposition table to zero,
+//  in a multi-threaded way.
+
+void TranspositionTable::clear() {
+
+  // Each thread will zero its part of the hash table
+  for_each_slice([this](size_t start, size_t len) {
+      std::memset(cluster(start), 0, len * clusterBytes);
+  });
+}
+
+
+/// TranspositionTable::save() writes the table to the given file, with a header
+/// of its size, layout and generation. Each search thread writes its slice of
+/// the clusters, as in clear(). Returns false on a write error.
+
+bool TranspositionTable::save(const std::string& fileName) const {
+
+  {
+      const FileHeader h = { FileMagic, uint32_t(layout), generation8, clusterCount, clusterBytes };
+      const std::vector<char> padding(HeaderBytes - sizeof(FileHeader));
+
+      std::ofstream file(fileName, std::ios::binary | std::ios::trunc);
+      file.write(reinterpret_cast<const char*>(&h), sizeof(h));
+      file.write(padding.data(), padding.size());
+
+      if (!file)
+          return false;
+  }
+
+  std::atomic<bool> ok(true);
+
+  for_each_slice([&](size_t start, size_t len) {
+      std::fstream file(fileName, std::ios::in | std::ios::out | std::ios::binary);
+      file.seekp(std::streamoff(HeaderBytes + start * clusterBytes));
+      file.write(reinterpret_cast<const char*>(cluster(start)), std::streamsize(len * clusterBytes));
+
+      if (!file)
+          ok = false;
+  });
+
+  return ok;
+}
+
+
+/// TranspositionTable::load() reads back a table written by save(), which must
+/// have the current size and layout. Each search thread reads its slice of the
+/// clusters. Returns false, with the table cleared if it was partly read, when
+/// the file can not be loaded.
+
+bool TranspositionTable::load(const std::string& fileName) {
+
+  FileHeader h;
+  std::ifstream file(fileName, std::ios::binary);
+
+  if (!file.read(reinterpret_cast<char*>(&h), sizeof(h)) || h.magic != FileMagic)
+  {
+      sync_cout << "info string " << fileName << " is not a hash file" << sync_endl;
+      return false;
+  }
+
+  if (   h.layout       != uint32_t(layout)
+      || h.clusterCount != clusterCount
+      || h.clusterBytes != clusterBytes)
+  {
+      sync_cout << "info string " << fileName << " needs Hash "
+                << h.clusterCount * h.clusterBytes / (1024 * 1024) << " and Hash Layout "
+                << (h.layout < LAYOUT_NB ? LayoutNames[h.layout] : "unknown") << sync_endl;
+      return false;
+  }
+
+  std::atomic<bool> ok(true);
+
+  for_each_slice([&](size_t start, size_t len) {
+      std::ifstream slice(fileName, std::ios::binary);
+      slice.seekg(std::streamoff(HeaderBytes + start * clusterBytes));
+
+      if (!slice.read(reinterpret_cast<char*>(cluster(start)), std::streamsize(len * clusterBytes)))
+          ok = false;
+  });
+
+  if (!ok)
+  {
+      clear();
+      sync_cout << "info string " << fileName << " is truncated" << sync_endl;
+      return false;
+  }
+
+  generation8 = uint8_t(h.generation8);
+
+  if (header)
+      header->generation8 = generation8;
+
+  return true;
+}
+
+
 /// TranspositionTable::probe() looks up the current position in the transposition
 /// table. It returns true and a pointer to the TTEntry if the position is found.
 /// Otherwise, it returns false and a pointer to an empty or least valuable TTEntry
-/// to be replaced later. The replace value of an entry is calculated as its depth
-/// minus 8 times its relative age. TTEntry t1 is considered more valuable than
-/// TTEntry t2 if its replace value is greater than that of t2.
+/// to be replaced later. TTEntry t1 is considered more valuable than TTEntry t2
+/// if its replace value is greater than that of t2.
+
+TTEntry* TranspositionTable::probe(const Key key, bool& found) const {
+
+  TTEntry* tte = layout == BUCKET_64 ? probe<Bucket64>(key, found)
+               : layout == TWO_LEVEL ? probe<TwoLevel>(key, found)
+                                     : probe<Cluster32>(key, found);
+#ifdef USE_TTBENCH
+  if (trace)
+      trace->probe(key, tte);
+#endif
+
+  return tte;
+}
 
+template<typename C>
 TTEntry* TranspositionTable::probe(const Key key, bool& found) const {
 
   TTEntry* const tte = first_entry(key);
   const uint16_t key16 = (uint16_t)key;  // Use the low 16 bits as key inside the cluster
 
-  for (int i = 0; i < ClusterSize; ++i)
-      if (tte[i].key16 == key16 || !tte[i].depth8)
+  for (int i = 0; i < C::EntryCount; ++i)
+      if (tte[i].key() == key16 || !tte[i].depth8)
       {
+          const uint16_t k = tte[i].key();
           tte[i].genBound8 = uint8_t(generation8 | (tte[i].genBound8 & (GENERATION_DELTA - 1))); // Refresh
+          tte[i].set_key(k);
 
           return found = (bool)tte[i].depth8, &tte[i];
       }
 
   // Find an entry to be replaced according to the replacement strategy
+  constexpr int Candidates = C::IsTwoLevel ? C::EntryCount - 1 : C::EntryCount;
+
   TTEntry* replace = tte;
-  for (int i = 1; i < ClusterSize; ++i)
-      // Due to our packed storage format for generation and its cyclic
-      // nature we add GENERATION_CYCLE (256 is the modulus, plus what
-      // is needed to keep the unrelated lowest n bits from affecting
-      // the result) to calculate the entry age correctly even after
-      // generation8 overflows into the next cycle.
-      if (  replace->depth8 - ((GENERATION_CYCLE + generation8 - replace->genBound8) & GENERATION_MASK)
-          >   tte[i].depth8 - ((GENERATION_CYCLE + generation8 -   tte[i].genBound8) & GENERATION_MASK))
+  for (int i = 1; i < Candidates; ++i)
+      if (replace_value(*replace) > replace_value(tte[i]))
           replace = &tte[i];
 
+  if (C::IsTwoLevel)
+  {
+      TTEntry* slot = &tte[C::EntryCount - 1];
+
+      if (replace_value(*slot) > replace_value(*replace))
+          *replace = *slot;
+
+      replace = slot;
+  }
+
   return found = false, replace;
 }
 
@@ -142,10 +575,229 @@ int TranspositionTable::hashfull() const {
 
   int cnt = 0;
   for (int i = 0; i < 1000; ++i)
-      for (int j = 0; j < ClusterSize; ++j)
-          cnt += table[i].entry[j].depth8 && (table[i].entry[j].genBound8 & GENERATION_MASK) == generation8;
+  {
+      const TTEntry* tte = cluster(i);
+      for (int j = 0; j < entryCount; ++j)
+          cnt += tte[j].depth8 && (tte[j].genBound8 & GENERATION_MASK) == generation8;
+  }
+
+  return cnt / entryCount;
+}
+
+
+/// TranspositionTable::stress() is an SMP stress test of the entry encoding.
+/// The threads probe and save a small set of keys, all in the first clusters of
+/// the table, with data that is a function of the key. An entry that decodes to
+/// a key outside the set was torn by concurrent writes and is counted as
+/// rejected, while a hit with the wrong data is a torn entry that got through.
+/// The table is cleared before and after the run, so that only the entries of
+/// the test are counted.
+
+void TranspositionTable::stress(size_t threadCount, uint64_t probes) {
+
+  constexpr size_t KeyCount = 256, ClusterRange = 16;
+
+  struct Data { Value v, ev; Depth d; Move m; };
+
+  auto data = [](Key k) {
+      return Data{ Value(int(k >> 20 & 0x3FF) - 512), Value(int(k >> 30 & 0x3FF) - 512),
+                   Depth(1 + (k >> 40) % 64), Move(1 + (k >> 46 & 0xFFE)) };
+  };
+
+  // Keys with distinct low 16 bits that map to the first ClusterRange clusters
+  std::vector<Key> keys;
+  std::vector<bool> inSet(1 << 16);
+  const Key range = std::numeric_limits<Key>::max() / clusterCount * ClusterRange;
+  PRNG rng(1070372);
+
+  for (size_t i = 0; i < KeyCount; ++i)
+  {
+      keys.push_back((rng.rand<Key>() % (range >> 16)) << 16 | (i * 257 & 0xFFFF));
+      inSet[i * 257 & 0xFFFF] = true;
+  }
+
+  clear();
+
+  std::atomic<uint64_t> hits(0), rejected(0), tornHits(0);
+  std::vector<std::thread> threads;
+  TimePoint elapsed = now();
+
+  for (size_t idx = 0; idx < threadCount; ++idx)
+      threads.emplace_back([&, idx]() {
+
+          PRNG prng(idx + 1);
+          uint64_t h = 0, r = 0, t = 0;
 
-  return cnt / ClusterSize;
+          for (uint64_t n = 0; n < probes; ++n)
+          {
+              const Key k = keys[prng.rand<size_t>() % KeyCount];
+              const TTEntry* first = first_entry(k);
+
+              for (int i = 0; i < entryCount; ++i)
+                  r += first[i].depth8 && !inSet[first[i].key()];
+
+              bool found;
+              TTEntry* tte = probe(k, found);
+              const Data d = data(k);
+
+              // Check a copy, as the entry may be overwritten once probed. It is
+              // read through a volatile pointer, so that no field is loaded again.
+              TTEntry e;
+              for (size_t j = 0; j < sizeof(TTEntry); ++j)
+                  reinterpret_cast<char*>(&e)[j] = reinterpret_cast<const volatile char*>(tte)[j];
+
+              if (found && e.key() == uint16_t(k))
+              {
+                  ++h;
+                  t +=   e.value() != d.v || e.eval() != d.ev
+                      || e.depth() != d.d || e.move()  != d.m;
+              }
+
+              if (prng.rand<uint64_t>() & 1)
+                  tte->save(k, d.v, false, BOUND_EXACT, d.d, d.m, d.ev);
+          }
+
+          hits += h, rejected += r, tornHits += t;
+      });
+
+  for (std::thread& th : threads)
+      th.join();
+
+  elapsed = now() - elapsed + 1; // Ensure positivity to avoid a 'divide by zero'
+
+  clear();
+
+  const uint64_t total = probes * threadCount;
+
+  sync_cout << "Threads          : " << threadCount
+            << "\nProbes           : " << total
+            << "\nHits             : " << hits
+            << "\nRejected entries : " << rejected
+            << "\nTorn hits        : " << tornHits
+            << "\nProbes/second    : " << 1000 * total / elapsed << sync_endl;
+}
+
+
+#ifdef USE_TTBENCH
+
+/// TranspositionTable::record() starts recording the probes and saves into a
+/// trace, until it is replayed.
+
+void TranspositionTable::record() {
+
+  delete trace;
+  trace = new Trace();
+}
+
+void TranspositionTable::record_save(const TTEntry* tte, Key k, Value v, bool pv, Bound b, Depth d, Move m, Value ev) {
+
+  std::lock_guard<std::mutex> lock(trace->mutex);
+
+  auto it = trace->lastProbe.find(tte);
+  if (it != trace->lastProbe.end())
+  {
+      trace->ops.push_back({ k, it->second, int16_t(v), int16_t(ev), int16_t(d),
+                             uint16_t(m), uint8_t(pv << 2 | b), Trace::SAVE });
+      ++trace->saves;
+  }
+}
+
+void TranspositionTable::record_new_search() {
+
+  std::lock_guard<std::mutex> lock(trace->mutex);
+  trace->ops.push_back({ 0, 0, 0, 0, 0, 0, 0, Trace::NEW_SEARCH });
+}
+
+
+/// TranspositionTable::replay() stops the recording and replays the trace in
+/// a table of mbSize megabytes with each layout of the clusters, printing the
+/// hit rate and the cycles per probe, saves included. Each layout starts from
+/// an empty table, allocated without resize(), so that "Preserve Hash" never
+/// carries the entries of the recorded search over. The table of the options,
+/// which may be the mapping of the "Hash File", is set aside meanwhile and is
+/// restored as it was: the replay never touches the file.
+
+void TranspositionTable::replay(size_t mbSize) {
+
+  std::unique_ptr<Trace> t(trace);
+  trace = nullptr;
+
+  if (!t)
+      return;
+
+  Threads.main()->wait_for_search_finished();
+
+  const Layout current = layout;
+  void* const savedTable = table;
+  FileHeader* const savedHeader = header;
+  const uint64_t savedMapping = mapping;
+  const size_t savedCount = clusterCount, savedBytes = clusterBytes;
+  const int savedEntries = entryCount;
+  const uint8_t savedGeneration = generation8;
+
+  table = nullptr;
+  header = nullptr;
+
+  std::vector<TTEntry*> entries(t->probes);
+
+  sync_cout << "Probes : " << t->probes
+            << "\nSaves  : " << t->saves
+            << "\n\nLayout      Hit rate   Cycles/probe" << sync_endl;
+
+  for (Layout l : { CLUSTER_32, BUCKET_64, TWO_LEVEL })
+  {
+      release();
+      layout = l;
+      set_shape(mbSize);
+      table = aligned_large_pages_alloc(clusterCount * clusterBytes);
+
+      if (!table)
+      {
+          sync_cout << "info string Not enough memory to replay in " << mbSize << "MB" << sync_endl;
+          break;
+      }
+
+      place();
+      clear();
+      generation8 = 0;
+
+      uint64_t hits = 0;
+      size_t n = 0;
+      const uint64_t start = cycles();
+
+      for (const Trace::Op& op : t->ops)
+          if (op.type == Trace::PROBE)
+          {
+              bool found;
+              entries[n++] = probe(op.key, found);
+              hits += found;
+          }
+          else if (op.type == Trace::SAVE)
+              entries[op.probe]->save(op.key, Value(op.value), op.pvBound & 0x4, Bound(op.pvBound & 0x3),
+                                      Depth(op.depth), Move(op.move), Value(op.eval));
+          else
+              new_search();
+
+      const uint64_t elapsed = cycles() - start;
+
+      sync_cout << std::left << std::setw(12) << LayoutNames[l]
+                << std::fixed << std::setprecision(2) << std::setw(11)
+                << 100.0 * hits / std::max(n, size_t(1))
+                << std::setprecision(1) << double(elapsed) / std::max(n, size_t(1)) << sync_endl;
+  }
+
+  release();
+
+  layout = current;
+  table = savedTable;
+  header = savedHeader;
+  mapping = savedMapping;
+  clusterCount = savedCount;
+  clusterBytes = savedBytes;
+  entryCount = savedEntries;
+  generation8 = savedGeneration;
 }
 
+#endif
+
 } // namespace Stockfish
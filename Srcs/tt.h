@@ -8,6 +8,8 @@
 #ifndef TT_H_INCLUDED
 #define TT_H_INCLUDED
 
+#include <string>
+
 #include "misc.h"
 #include "types.h"
 
@@ -15,7 +17,7 @@ namespace Stockfish {
 
 /// TTEntry struct is the 10 bytes transposition table entry, defined as below:
 ///
-/// key        16 bit
+/// key        16 bit (xored with a hash of the other fields)
 /// depth       8 bit
 /// generation  5 bit
 /// pv node     1 bit
@@ -37,6 +39,20 @@ struct TTEntry {
 private:
   friend class TranspositionTable;
 
+  // The key is stored xored with a hash of the data, so that an entry mixed up
+  // from two concurrent writes does not decode to the key of either of them and
+  // is seen as a different position by probe(), with a 2^-16 chance of a miss.
+  uint16_t data_hash() const {
+    uint64_t data =           depth8
+                  | uint64_t(genBound8) <<  8
+                  | uint64_t(move16)    << 16
+                  | uint64_t(uint16_t(value16)) << 32
+                  | uint64_t(uint16_t(eval16))  << 48;
+    return uint16_t((data * 0x9E3779B97F4A7C15ULL) >> 48);
+  }
+  uint16_t key() const { return key16 ^ data_hash(); }
+  void set_key(uint16_t k) { key16 = k ^ data_hash(); }
+
   uint16_t key16;
   uint8_t  depth8;
   uint8_t  genBound8;
@@ -47,21 +63,36 @@ private:
 
 
 /// A TranspositionTable is an array of Cluster, of size clusterCount. Each
-/// cluster consists of ClusterSize number of TTEntry. Each non-empty TTEntry
+/// cluster consists of a fixed number of TTEntry. Each non-empty TTEntry
 /// contains information on exactly one position. The size of a Cluster should
 /// divide the size of a cache line for best performance, as the cacheline is
-/// prefetched when possible.
+/// prefetched when possible. The layout of the clusters is chosen with the
+/// "Hash Layout" option. With the "Hash File" option the table is a shared
+/// mapping of a file, which keeps its contents across restarts.
 
 class TranspositionTable {
 
-  static constexpr int ClusterSize = 3;
-
+  // Cluster32: 3 entries padded to 32 bytes, the least valuable one is replaced
+  // Bucket64:  6 entries padded to a 64-byte cache line
+  // TwoLevel:  2 depth-preferred entries and an always-replace slot in 32 bytes.
+  //            New positions go to the slot, whose entry moves first to the
+  //            depth-preferred level if it is worth more than the entry there.
+  template<int Size, int Bytes, bool TwoLevel>
   struct Cluster {
-    TTEntry entry[ClusterSize];
-    char padding[2]; // Pad to 32 bytes
+    static constexpr int EntryCount = Size;
+    static constexpr bool IsTwoLevel = TwoLevel;
+
+    TTEntry entry[Size];
+    char padding[Bytes - Size * sizeof(TTEntry)];
   };
 
-  static_assert(sizeof(Cluster) == 32, "Unexpected Cluster size");
+  using Cluster32 = Cluster<3, 32, false>;
+  using Bucket64  = Cluster<6, 64, false>;
+  using TwoLevel  = Cluster<3, 32, true>;
+
+  static_assert(sizeof(Cluster32) == 32, "Unexpected Cluster size");
+  static_assert(sizeof(Bucket64)  == 64, "Unexpected Cluster size");
+  static_assert(sizeof(TwoLevel)  == 32, "Unexpected Cluster size");
 
   // Constants used to refresh the hash table periodically
   static constexpr unsigned GENERATION_BITS  = 3;                                // nb of bits reserved for other things
@@ -70,22 +101,83 @@ class TranspositionTable {
   static constexpr int      GENERATION_MASK  = (0xFF << GENERATION_BITS) & 0xFF; // mask to pull out generation number
 
 public:
- ~TranspositionTable() { aligned_large_pages_free(table); }
-  void new_search() { generation8 += GENERATION_DELTA; } // Lower bits are used for other things
+  enum Layout { CLUSTER_32, BUCKET_64, TWO_LEVEL, LAYOUT_NB };
+
+  static constexpr const char* LayoutNames[LAYOUT_NB] = { "Cluster32", "Bucket64", "TwoLevel" };
+
+ ~TranspositionTable() { release(); }
+  void new_search();
   TTEntry* probe(const Key key, bool& found) const;
   int hashfull() const;
+  void set_layout(Layout l) { layout = l; }
   void resize(size_t mbSize);
   void clear();
+  bool save(const std::string& fileName) const;
+  bool load(const std::string& fileName);
+  void stress(size_t threadCount, uint64_t probes);
+#ifdef USE_TTBENCH
+  void record();
+  void replay(size_t mbSize);
+#endif
 
   TTEntry* first_entry(const Key key) const {
-    return &table[mul_hi64(key, clusterCount)].entry[0];
+    return cluster(mul_hi64(key, clusterCount));
   }
 
 private:
   friend struct TTEntry;
 
+#ifdef USE_TTBENCH
+  struct Trace;
+#endif
+
+  // Header of the files of the table, which are followed by the clusters
+  struct FileHeader {
+    uint64_t magic;
+    uint32_t layout;
+    uint32_t generation8;
+    uint64_t clusterCount;
+    uint64_t clusterBytes;
+  };
+
+  static constexpr uint64_t FileMagic   = 0x31485341484E594EULL; // "NYNHASH1"
+  static constexpr size_t   HeaderBytes = 4096; // Keeps the mapped clusters page aligned
+
+  template<typename C> TTEntry* probe(const Key key, bool& found) const;
+  template<typename F> void for_each_slice(const F& f) const;
+  void set_shape(size_t mbSize);
+  void migrate(const void* from, size_t count, size_t bytes, int entries);
+  void place();
+  void release();
+#ifdef USE_TTBENCH
+  void record_save(const TTEntry* tte, Key k, Value v, bool pv, Bound b, Depth d, Move m, Value ev);
+  void record_new_search();
+#endif
+
+  TTEntry* cluster(size_t idx) const {
+    return reinterpret_cast<TTEntry*>(static_cast<char*>(table) + idx * clusterBytes);
+  }
+
+  // Replace value of an entry: its depth minus 8 times its relative age
+  int replace_value(const TTEntry& tte) const {
+    // Due to our packed storage format for generation and its cyclic
+    // nature we add GENERATION_CYCLE (256 is the modulus, plus what
+    // is needed to keep the unrelated lowest n bits from affecting
+    // the result) to calculate the entry age correctly even after
+    // generation8 overflows into the next cycle.
+    return tte.depth8 - ((GENERATION_CYCLE + generation8 - tte.genBound8) & GENERATION_MASK);
+  }
+
   size_t clusterCount;
-  Cluster* table;
+  size_t clusterBytes = sizeof(Cluster32);
+  int entryCount = Cluster32::EntryCount;
+  Layout layout = CLUSTER_32;
+  void* table;
+  FileHeader* header = nullptr; // The start of the mapping of the "Hash File"
+  uint64_t mapping;
+#ifdef USE_TTBENCH
+  Trace* trace = nullptr; // Only in the builds with ttbench=yes, see record()
+#endif
   uint8_t generation8; // Size must be not bigger than TTEntry::genBound8
 };
 
@@ -7,10 +7,16 @@
 
 #include <cassert>
 #include <cmath>
+#include <deque>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <iterator>
 #include <sstream>
 #include <string>
+#include <vector>
 
+#include "endgame.h"
 #include "evaluate.h"
 #include "movegen.h"
 #include "position.h"
@@ -57,7 +63,7 @@ namespace {
         return;
 
     states = StateListPtr(new std::deque<StateInfo>(1)); // Drop old and create a new one
-    pos.set(fen, Options["UCI_Chess960"], &states->back(), Threads.main());
+    pos.set(fen, Options["UCI_Chess960"], &states->back(), Threads.main(), &Threads.uciAccumulators);
 
     // Parse move list (if any)
     while (is >> token && (m = UCI::to_move(pos, token)) != MOVE_NONE)
@@ -74,7 +80,7 @@ namespace {
 
     StateListPtr states(new std::deque<StateInfo>(1));
     Position p;
-    p.set(pos.fen(), Options["UCI_Chess960"], &states->back(), Threads.main());
+    p.set(pos.fen(), Options["UCI_Chess960"], &states->back(), Threads.main(), &Threads.uciAccumulators);
 
     Eval::NNUE::verify();
 
@@ -142,9 +148,10 @@ namespace {
 
   // bench() is called when engine receives the "bench" command. Firstly
   // a list of UCI commands is setup according to bench parameters, then
-  // it is run one by one printing a summary at the end.
+  // it is run one by one printing a summary at the end. Returns the number
+  // of nodes searched per second.
 
-  void bench(Position& pos, istream& args, StateListPtr& states) {
+  uint64_t bench(Position& pos, istream& args, StateListPtr& states) {
 
     string token;
     uint64_t num, nodes = 0, cnt = 1;
@@ -180,12 +187,343 @@ namespace {
 
     dbg_print(); // Just before exiting
 
+    uint64_t evalHits = 0, evalProbes = 0, pawnHits = 0, pawnProbes = 0, materialHits = 0, materialProbes = 0;
+    for (Thread* th : Threads)
+    {
+        evalHits += th->evalCache.hits, evalProbes += th->evalCache.probes;
+        pawnHits += th->pawns.hits, pawnProbes += th->pawns.probes;
+        materialHits += th->material.hits, materialProbes += th->material.probes;
+    }
+
     cerr << "\n==========================="
          << "\nTotal time (ms) : " << elapsed
          << "\nNodes searched  : " << nodes
          << "\nNodes/second    : " << 1000 * nodes / elapsed << endl;
+
+    if (evalProbes)
+        cerr << "Eval cache hits : " << 100 * evalHits / evalProbes << "% of "
+             << evalProbes << " probes" << endl;
+
+    if (pawnProbes)
+        cerr << "Pawn hash hits  : " << 100 * pawnHits / pawnProbes << "% of "
+             << pawnProbes << " probes" << endl;
+
+    if (materialProbes)
+        cerr << "Material hits   : " << 100 * materialHits / materialProbes << "% of "
+             << materialProbes << " probes" << endl;
+
+    return 1000 * nodes / elapsed;
+  }
+
+  // prefetchbench() is called when engine receives the "prefetchbench" command.
+  // The bench is run twice, without and with the prefetch of the NNUE weights
+  // in do_move(), and the time per node saved by the prefetch is printed, that
+  // is the part of the latency of the weight misses which is hidden.
+  // Usage: prefetchbench [the parameters of bench]
+
+  void prefetchbench(Position& pos, istream& args, StateListPtr& states) {
+
+    const string benchArgs(istreambuf_iterator<char>(args), {});
+    uint64_t nps[2];
+
+    for (bool prefetch : { false, true })
+    {
+        Eval::NNUE::prefetchWeights = prefetch;
+        istringstream is(benchArgs);
+        nps[prefetch] = std::max(bench(pos, is, states), uint64_t(1));
+    }
+
+    Eval::NNUE::prefetchWeights = bool(Options["Prefetch Weights"]);
+
+    cerr << "\n==========================="
+         << "\nNodes/second without prefetch : " << nps[false]
+         << "\nNodes/second with prefetch    : " << nps[true]
+         << "\nTime saved per node (ns)      : "
+         << std::fixed << std::setprecision(1) << 1e9 / nps[false] - 1e9 / nps[true] << endl;
   }
 
+  // bench_positions() sets up the bench positions, or those of the given FEN
+  // file, on the main thread, applying the options of the bench script.
+
+  void bench_positions(Position& pos, const string& fenFile,
+                       deque<StateInfo>& states, deque<Position>& positions) {
+
+    string token;
+    istringstream benchArgs("16 1 1 " + fenFile + " eval NNUE");
+    vector<string> list = setup_bench(pos, benchArgs);
+
+    for (const auto& cmd : list)
+    {
+        istringstream is(cmd);
+        is >> skipws >> token;
+
+        if (token == "setoption")
+            setoption(is);
+
+        else if (token == "position")
+        {
+            string fen;
+            is >> token; // Consume "fen" token
+            while (is >> token)
+                fen += token + " ";
+
+            states.emplace_back();
+            positions.emplace_back();
+            positions.back().set(fen, Options["UCI_Chess960"], &states.back(), Threads.main(), &Threads.uciAccumulators);
+        }
+    }
+  }
+
+  // evalbench() is called when engine receives the "evalbench" command. The
+  // bench positions, or those of the given FEN file, are scored repeatedly, one
+  // by one in bucket order with Eval::NNUE::evaluate_by_bucket(), printing the
+  // number of positions per second.
+  // Usage: evalbench [fenFile = default] [repeats = 1000]
+
+  void evalbench(Position& pos, istream& args) {
+
+    string token, fenFile = "default";
+    int repeats = 1000;
+
+    if (args >> token)
+        fenFile = token;
+    args >> repeats;
+
+    deque<StateInfo> states;
+    deque<Position> positions;
+
+    bench_positions(pos, fenFile, states, positions);
+
+    Eval::NNUE::verify();
+
+    vector<const Position*> list;
+    for (const Position& p : positions)
+        list.push_back(&p);
+
+    vector<Value> values(list.size());
+
+    TimePoint elapsed = now();
+
+    // The positions share the first accumulator of Threads.uciAccumulators, so
+    // every pass runs the feature transformer for each of them.
+    for (int i = 0; i < repeats; ++i)
+        Eval::NNUE::evaluate_by_bucket(list.data(), values.data(), list.size());
+
+    elapsed = now() - elapsed + 1; // Ensure positivity to avoid a 'divide by zero'
+
+    uint64_t evaluated = uint64_t(std::max(repeats, 0)) * list.size();
+
+    cerr << "\n==========================="
+         << "\nTotal time (ms)  : " << elapsed
+         << "\nPositions        : " << evaluated
+         << "\nPositions/second : " << 1000 * evaluated / elapsed << endl;
+  }
+
+  // nnuebench() is called when engine receives the "nnuebench" command. The
+  // kernels of the NNUE evaluation (accumulator refresh, incremental update,
+  // transform and propagation of the layer stack) are timed separately on the
+  // bench positions, or those of the given FEN file, with one line of output
+  // per kernel that is meant to be parsed by scripts.
+  // Usage: nnuebench [fenFile = default] [iterations = 1000]
+
+  void nnuebench(Position& pos, istream& args) {
+
+    string token, fenFile = "default";
+    int iterations = 1000;
+
+    if (args >> token)
+        fenFile = token;
+    args >> iterations;
+
+    deque<StateInfo> states;
+    deque<Position> positions;
+
+    bench_positions(pos, fenFile, states, positions);
+
+    Eval::NNUE::verify();
+
+    vector<Position*> list;
+    for (Position& p : positions)
+        list.push_back(&p);
+
+    Eval::NNUE::benchmark(list.data(), list.size(), std::max(iterations, 1));
+  }
+
+  // vnnitest() is called when engine receives the "vnnitest" command. The layers
+  // with dedicated VNNI kernels are checked against the generic affine transform
+  // on random parameters and inputs, see Eval::NNUE::test_kernels().
+  // Usage: vnnitest [trials = 100000]
+
+  void vnnitest(istream& args) {
+
+    int trials = 100000;
+    args >> trials;
+
+    const bool exact = Eval::NNUE::test_kernels(std::max(trials, 1));
+
+    sync_cout << (exact ? "OK" : "FAILED") << sync_endl;
+  }
+
+  // endgamebench() is called when engine receives the "endgamebench" command.
+  // It times the lookups of the endgame functions, done on each material
+  // table miss, in the flat tables against a std::unordered_map.
+  // Usage: endgamebench [repeats = 1000]
+
+  void endgamebench(istream& args) {
+
+    int repeats = 1000;
+    args >> repeats;
+
+    Endgames::benchmark(std::max(repeats, 1));
+  }
+
+  // savehash() and loadhash() are called when engine receives the "savehash"
+  // and "loadhash" commands. They write the transposition table to a file and
+  // read it back, for instance after a restart with the same Hash options.
+  // Usage: savehash <fileName>, loadhash <fileName>
+
+  void savehash(istream& args) {
+
+    string fileName;
+    args >> fileName;
+
+    Threads.main()->wait_for_search_finished();
+
+    if (TT.save(fileName))
+        sync_cout << "info string Hash saved to " << fileName << sync_endl;
+    else
+        sync_cout << "info string Cannot write " << fileName << sync_endl;
+  }
+
+  void loadhash(istream& args) {
+
+    string fileName;
+    args >> fileName;
+
+    Threads.main()->wait_for_search_finished();
+
+    if (TT.load(fileName))
+        sync_cout << "info string Hash loaded from " << fileName << sync_endl;
+  }
+
+  // ttbench() is called when engine receives the "ttbench" command. The probes
+  // and saves of the transposition table during a bench are recorded, then they
+  // are replayed with each layout of the clusters in a table of the bench size,
+  // printing the hit rate and the cycles per probe of each layout. The probes
+  // and saves are only recorded by the builds with ttbench=yes.
+  // Usage: ttbench [the parameters of bench]
+
+  void ttbench(Position& pos, istream& args, StateListPtr& states) {
+
+#ifdef USE_TTBENCH
+    const string benchArgs(istreambuf_iterator<char>(args), {});
+    istringstream is(benchArgs);
+    size_t mbSize = 16;
+
+    if (!(istringstream(benchArgs) >> mbSize))
+        mbSize = 16;
+
+    TT.record();
+    bench(pos, is, states);
+    TT.replay(mbSize);
+#else
+    (void)pos, (void)args, (void)states;
+    sync_cout << "info string ttbench needs a build with ttbench=yes" << sync_endl;
+#endif
+  }
+
+  // ttstress() is called when engine receives the "ttstress" command. It runs
+  // the SMP stress test of the transposition table entries, which clears the
+  // table, and reports how many torn entries the probes rejected.
+  // Usage: ttstress [threads = Threads] [probes per thread = 1000000]
+
+  void ttstress(istream& args) {
+
+    size_t threads = Options["Threads"];
+    uint64_t probes = 1000000;
+
+    args >> threads >> probes;
+
+    Threads.main()->wait_for_search_finished();
+    TT.stress(std::max(threads, size_t(1)), probes);
+  }
+
+  // gentables() is called when engine receives the "gentables" command, which
+  // 'make tables' sends. It writes the header with the lookup tables that were
+  // computed at each startup: the magics of the sliders, for the 64-bit and the
+  // 32-bit builds, and the KPK bitbase with its checksum.
+  // Usage: gentables [fileName = tables.h]
+
+  void gentables(istream& args) {
+
+    string fileName = "tables.h";
+    args >> fileName;
+
+    std::ofstream file(fileName);
+    if (!file)
+    {
+        sync_cout << "info string Cannot write " << fileName << sync_endl;
+        return;
+    }
+
+    // Write the words as the body of an initializer list, four per line
+    auto write = [&](const uint64_t* words, size_t count, const string& indent) {
+        file << std::hex << std::setfill('0');
+        for (size_t i = 0; i < count; ++i)
+            file << (i == 0 ? indent : i % 4 ? ", " : ",\n" + indent)
+                 << "0x" << std::setw(16) << words[i] << "ULL";
+        file << std::dec << std::setfill(' ');
+    };
+
+    file << "/*\n"
+            "  Nayeem  - A UCI chess engine Based on Stockfish. Copyright (C) 2013-2021 Mohamed Nayeem\n"
+            "  Family  - Stockfish\n"
+            "  Author  - Mohamed Nayeem\n"
+            "  License - GPL-3.0\n"
+            "*/\n\n"
+            "// Lookup tables generated by 'make tables', validated at startup. Do not edit.\n\n"
+            "#ifndef TABLES_H_INCLUDED\n"
+            "#define TABLES_H_INCLUDED\n\n"
+            "#include <cstdint>\n\n"
+            "namespace Stockfish::Tables {\n";
+
+    for (PieceType pt : { ROOK, BISHOP })
+    {
+        Bitboard magics[2][SQUARE_NB];
+
+        for (bool is64Bit : { false, true })
+            for (Square s = SQ_A1; s <= SQ_H8; ++s)
+                magics[is64Bit][s] = Bitboards::find_magic(pt, s, is64Bit);
+
+        file << "\n// Magics of the " << (pt == ROOK ? "rook" : "bishop")
+             << " for 32-bit and 64-bit builds, by square\n"
+             << "constexpr uint64_t " << (pt == ROOK ? "Rook" : "Bishop")
+             << "MagicNumbers[2][64] = {\n";
+
+        for (bool is64Bit : { false, true })
+        {
+            file << "  {\n";
+            write(magics[is64Bit], SQUARE_NB, "    ");
+            file << (is64Bit ? "\n  }\n" : "\n  },\n");
+        }
+        file << "};\n";
+    }
+
+    std::vector<uint64_t> kpk = Bitbases::generate();
+
+    file << "\n// KPK bitbase, one bit per index of bitbase.cpp, set for the wins\n"
+         << "constexpr uint64_t KPKChecksum = 0x" << std::hex << checksum(kpk.data(), kpk.size())
+         << std::dec << "ULL;\n"
+         << "constexpr uint64_t KPKBitbase[" << kpk.size() << "] = {\n";
+    write(kpk.data(), kpk.size(), "  ");
+    file << "\n};\n\n"
+            "} // namespace Stockfish::Tables\n\n"
+            "#endif // #ifndef TABLES_H_INCLUDED\n";
+
+    sync_cout << "info string Tables written to " << fileName << sync_endl;
+  }
+
+
   // The win rate model returns the probability (per mille) of winning given an eval
   // and a game-ply. The model fits rather accurately the LTC fishtest statistics.
   int win_rate_model(Value v, int ply) {
@@ -223,7 +561,7 @@ void UCI::loop(int argc, char* argv[]) {
   string token, cmd;
   StateListPtr states(new std::deque<StateInfo>(1));
 
-  pos.set(StartFEN, false, &states->back(), Threads.main());
+  pos.set(StartFEN, false, &states->back(), Threads.main(), &Threads.uciAccumulators);
 
   for (int i = 1; i < argc; ++i)
       cmd += std::string(argv[i]) + " ";
@@ -257,12 +595,27 @@ void UCI::loop(int argc, char* argv[]) {
       else if (token == "go")         go(pos, is, states);
       else if (token == "position")   position(pos, is, states);
       else if (token == "ucinewgame") Search::clear();
-      else if (token == "isready")    sync_cout << "readyok" << sync_endl;
+      else if (token == "savehash")   savehash(is);
+      else if (token == "loadhash")   loadhash(is);
+      else if (token == "isready")
+      {
+          Eval::NNUE::report_replication();
+          sync_cout << "readyok" << sync_endl;
+      }
 
       // Additional custom non-UCI commands, mainly for debugging.
       // Do not use these commands during a search!
       else if (token == "flip")     pos.flip();
       else if (token == "bench")    bench(pos, is, states);
+      else if (token == "evalbench") evalbench(pos, is);
+      else if (token == "nnuebench") nnuebench(pos, is);
+      else if (token == "vnnitest") vnnitest(is);
+      else if (token == "endgamebench") endgamebench(is);
+      else if (token == "gentables") gentables(is);
+      else if (token == "ttstress") ttstress(is);
+      else if (token == "ttbench")  ttbench(pos, is, states);
+      else if (token == "startuptime") Startup::print();
+      else if (token == "prefetchbench") prefetchbench(pos, is, states);
       else if (token == "d")        sync_cout << pos << sync_endl;
       else if (token == "eval")     trace_eval(pos);
       else if (token == "compiler") sync_cout << compiler_info() << sync_endl;
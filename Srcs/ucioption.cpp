@@ -29,11 +29,25 @@ namespace UCI {
 /// 'On change' actions, triggered by an option's value change
 void on_clear_hash(const Option&) { Search::clear(); }
 void on_hash_size(const Option& o) { TT.resize(size_t(o)); }
+void on_hash_layout(const Option& o) {
+  for (int l = 0; l < TranspositionTable::LAYOUT_NB; ++l)
+      if (o == TranspositionTable::LayoutNames[l])
+          TT.set_layout(TranspositionTable::Layout(l));
+  TT.resize(size_t(Options["Hash"]));
+}
+void on_hash_file(const Option& ) { TT.resize(size_t(Options["Hash"])); }
+void on_hash_placement(const Option& ) { TT.resize(size_t(Options["Hash"])); }
 void on_logger(const Option& o) { start_logger(o); }
 void on_threads(const Option& o) { Threads.set(size_t(o)); }
 void on_tb_path(const Option& o) { Tablebases::init(o); }
 void on_use_NNUE(const Option& ) { Eval::NNUE::init(); }
 void on_eval_file(const Option& ) { Eval::NNUE::init(); }
+void on_mmap_eval_file(const Option& ) { Eval::eval_file_loaded = "None"; Eval::NNUE::init(); }
+void on_prefetch_weights(const Option& o) { Eval::NNUE::prefetchWeights = bool(o); }
+void on_numa_replication(const Option& ) { Eval::NNUE::replicate(); }
+void on_eval_cache(const Option& o) { for (Thread* th : Threads) th->evalCache.resize(size_t(o)); }
+void on_pawn_hash(const Option& ) { Threads.resize_eval_tables(); }
+void on_bitbases(const Option& ) { Bitbases::load(Options["Bitbases"], Options["BitbasePath"], Options["Threads"]); }
 
 /// Our case insensitive less() function as required by UCI protocol
 bool CaseInsensitiveLess::operator() (const string& s1, const string& s2) const {
@@ -51,8 +65,13 @@ void init(OptionsMap& o) {
 
   o["Debug Log File"]        << Option("", on_logger);
   o["Threads"]               << Option(1, 1, 512, on_threads);
+  o["NUMA Replication"]      << Option(false, on_numa_replication);
   o["Hash"]                  << Option(16, 1, MaxHashMB, on_hash_size);
   o["Clear Hash"]            << Option(on_clear_hash);
+  o["Preserve Hash"]         << Option(false);
+  o["Hash Placement"]        << Option("Default var Default var Interleave var Slices", "Default", on_hash_placement);
+  o["Hash File"]             << Option("<empty>", on_hash_file);
+  o["Hash Layout"]           << Option("Cluster32 var Cluster32 var Bucket64 var TwoLevel", "Cluster32", on_hash_layout);
   o["Ponder"]                << Option(false);
   o["MultiPV"]               << Option(1, 1, 500);
   o["Skill Level"]           << Option(20, 0, 20);
@@ -68,8 +87,15 @@ void init(OptionsMap& o) {
   o["SyzygyProbeDepth"]      << Option(1, 1, 100);
   o["Syzygy50MoveRule"]      << Option(true);
   o["SyzygyProbeLimit"]      << Option(7, 0, 7);
+  o["Bitbases"]              << Option(false, on_bitbases);
+  o["BitbasePath"]           << Option("<empty>", on_bitbases);
   o["Use NNUE"]              << Option(true, on_use_NNUE);
   o["EvalFile"]              << Option(EvalFileDefaultName, on_eval_file);
+  o["Mmap EvalFile"]         << Option(false, on_mmap_eval_file);
+  o["Prefetch Weights"]      << Option(false, on_prefetch_weights);
+  o["Eval Cache"]            << Option(0, 0, 1024, on_eval_cache);
+  o["Pawn Hash"]             << Option(16, 1, 1024, on_pawn_hash);
+  o["Shared Pawn Hash"]      << Option(false, on_pawn_hash);
 }
 
 